@@ -3,14 +3,15 @@
 set -xeuo pipefail
 
 books_dir=""
-polyglot_dir=""
 merged_file=""
 code_file=""
+format="gleam"
+threads="$(nproc)"
 
 print_help() {
   cat <<EOF
-Usage: $0 --books-dir books-dir --polyglot-dir polyglot-dir
-          --merged-file file --code-file file
+Usage: $0 --books-dir books-dir --merged-file file --code-file file
+          [--format gleam|etf|case|bits] [--threads n]
 
 EOF
 }
@@ -18,9 +19,10 @@ EOF
 while [ "$#" -gt 0 ]; do
   case "$1" in
     --books-dir)      books_dir="$2"; shift 2 ;;
-    --polyglot-dir)   polyglot_dir="$2"; shift 2 ;;
     --merged-file)    merged_file="$2"; shift 2 ;;
     --code-file)      code_file="$2"; shift 2 ;;
+    --format)         format="$2"; shift 2 ;;
+    --threads)        threads="$2"; shift 2 ;;
     *) print_help; exit 1 ;;
   esac
 done
@@ -30,11 +32,6 @@ if [ ! -d "$books_dir" ]; then
   exit 1
 fi
 
-if [ ! -d "$polyglot_dir" ]; then
-  echo "tables dir '$polyglot_dir' does not exist"
-  exit 1
-fi
-
 # Ensure we can create these files
 touch "$merged_file"
 touch "$code_file"
@@ -44,17 +41,9 @@ cd "$(dirname "$0")"
 meson setup build || true
 meson compile -C build
 
-polyglot_files=()
-
-for book in "$books_dir"/*.pgn; do
-  book_name="$(basename -s .pgn "$book")"
-  polyglot_file="$polyglot_dir/$book_name.bin"
-  polyglot_files+=("$polyglot_file")
-
-  echo "Processing $book into $polyglot_file"
-  build/polyglot-operator -v build --pgn "$book" --bin "$polyglot_file"
-done
-
-
-build/polyglot-operator -v merge --bins "${polyglot_files[@]}" --output "$merged_file"
-build/polyglot-operator codegen --bin "$merged_file" --output "$code_file"
+# All books are built in one process, in parallel, straight into the merged
+# file.
+build/polyglot-operator -v build-all --books-dir "$books_dir" \
+  --bin "$merged_file" --threads "$threads"
+build/polyglot-operator codegen --bin "$merged_file" --output "$code_file" \
+  --format "$format" --threads "$threads"
@@ -0,0 +1,578 @@
+#include "chess.h"
+#include "codegen.h"
+#include "entry_codec.h"
+#include "entry_sort.h"
+#include "mapped_file.h"
+#include "pg_builder.h"
+#include "pgn_gen.h"
+#include "polyglot.h"
+#include "san.h"
+#include "tinylogger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+/*
+ * Benchmarks for the polyglot-operator hot paths. Inputs are generated from
+ * a fixed seed, so numbers are comparable between runs and machines.
+ */
+
+using namespace chess;
+using namespace std;
+
+// Roughly the shape of a real book: a small set of positions makes up most
+// of the plies, with a long tail of positions that show up once.
+static vector<struct BookEntry> make_entries(size_t n, uint64_t seed) {
+  mt19937_64 rng(seed);
+  vector<uint64_t> common_keys(n / 64 + 1);
+  for (auto &key : common_keys) {
+    key = rng();
+  }
+
+  vector<struct BookEntry> entries(n);
+  for (auto &be : entries) {
+    bool common = rng() % 4 != 0;
+    be.key = common ? common_keys[rng() % common_keys.size()] : rng();
+    be.move = rng() % (common ? 8 : 4096);
+    be.weight = 1 + rng() % 2;
+    be.learn = 0;
+  }
+  return entries;
+}
+
+template <typename F> static double time_it(F fn) {
+  auto start = chrono::steady_clock::now();
+  fn();
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// The fastest of a few runs of `fn`, which has to do the same work each
+// time. Less noisy than a single run.
+template <typename F> static double best_of(F fn) {
+  double best = time_it(fn);
+  for (int i = 1; i < 3; i++) {
+    best = min(best, time_it(fn));
+  }
+  return best;
+}
+
+// `bytes` is how much each op processes, 0 if throughput makes no sense.
+static void report(const char *name, size_t n, double seconds, size_t bytes) {
+  printf("%-32s %12.2f ns/op", name, seconds * 1e9 / n);
+  if (bytes > 0) {
+    printf(" %10.1f MB/s", n * bytes / 1e6 / seconds);
+  }
+  printf("\n");
+}
+
+static bool same_entries(const vector<struct BookEntry> &a,
+                         const vector<struct BookEntry> &b) {
+  return a.size() == b.size() &&
+         equal(a.begin(), a.end(), b.begin(),
+               [](const struct BookEntry &x, const struct BookEntry &y) {
+                 return x.key == y.key && x.move == y.move &&
+                        x.weight == y.weight;
+               });
+}
+
+static int bench_sort(size_t n) {
+  auto input = make_entries(n, 42);
+  printf("sort and reduce %zu entries\n", n);
+
+  auto expected = input;
+  double seconds = time_it([&] {
+    sort(expected.begin(), expected.end());
+    expected = reduce_to_normal_form(expected);
+  });
+  report("std::sort + reduce_to_normal_form", n, seconds,
+         sizeof(struct BookEntry));
+
+  int max_threads = max(thread::hardware_concurrency(), 1u);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    auto entries = input;
+    seconds = time_it([&] { sort_and_reduce(entries, threads); });
+
+    char name[64];
+    snprintf(name, sizeof(name), "sort_and_reduce (%d threads)", threads);
+    report(name, n, seconds, sizeof(struct BookEntry));
+
+    if (!same_entries(entries, expected)) {
+      fprintf(stderr, "%s gave a different result\n", name);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// Collects the SAN of every move of the first `max_games` games.
+class SanCollector : public pgn::Visitor {
+public:
+  vector<vector<string>> games;
+  size_t max_games;
+
+  SanCollector(size_t limit) : max_games(limit) {}
+
+  void startPgn() {
+    if (games.size() < max_games) {
+      games.emplace_back();
+    } else {
+      skipPgn(true);
+    }
+  }
+
+  void header(string_view, string_view) {}
+
+  void startMoves() {}
+
+  void move(string_view san, string_view) {
+    games.back().emplace_back(san);
+  }
+
+  void endPgn() {}
+};
+
+// Only counts what the parser hands over, to time the parser on its own.
+class CountingVisitor : public pgn::Visitor {
+public:
+  size_t games = 0;
+  size_t plies = 0;
+
+  void startPgn() { games++; }
+
+  void header(string_view, string_view) {}
+
+  void startMoves() {}
+
+  void move(string_view, string_view) { plies++; }
+
+  void endPgn() {}
+};
+
+/*
+ * The PGN the PGN benchmarks run on: the file at `path`, or generated games
+ * if `path` is null or "-".
+ */
+class BenchPgn {
+public:
+  bool open(const char *path) {
+    if (path == nullptr || strcmp(path, "-") == 0) {
+      // Generated once, it takes a while.
+      static const string generated = [] {
+        struct PgnGenOptions opts = {.seed = 42,
+                                     .games = GENERATED_GAMES,
+                                     .min_plies = 20,
+                                     .max_plies = 160,
+                                     .opening_plies = 12,
+                                     .comment_rate = 30,
+                                     .nag_rate = 20,
+                                     .variation_rate = 10};
+        ostringstream strm;
+        generate_pgn(strm, opts, 1);
+        return strm.str();
+      }();
+      pgn = generated;
+      return true;
+    }
+    if (!file.open(path, MADV_SEQUENTIAL)) {
+      return false;
+    }
+    pgn = file.view();
+    return true;
+  }
+
+  string_view view() const { return pgn; }
+
+private:
+  static const size_t GENERATED_GAMES = 20000;
+
+  MappedFile file;
+  string_view pgn;
+};
+
+/*
+ * The games of `pgn`, up to `max_games` of them, as moves. Games are cut at
+ * the first move parseSan rejects, so `sans` and `moves` always line up.
+ */
+static void load_games(string_view pgn, size_t max_games,
+                       vector<vector<string>> &sans,
+                       vector<vector<Move>> &moves) {
+  SanCollector collector(max_games);
+  pgn::StreamParser parser(pgn);
+  parser.readGames(collector);
+  sans = std::move(collector.games);
+
+  moves.assign(sans.size(), {});
+  Board board;
+  for (size_t g = 0; g < sans.size(); g++) {
+    board.setFen(constants::STARTPOS);
+    for (const auto &san : sans[g]) {
+      Move move;
+      try {
+        move = uci::parseSan(board, san);
+      } catch (const exception &e) {
+        break;
+      }
+      moves[g].push_back(move);
+      board.makeMove(move);
+    }
+    sans[g].resize(moves[g].size());
+  }
+}
+
+static int bench_parse(const char *path) {
+  BenchPgn pgn;
+  if (!pgn.open(path)) {
+    return EXIT_FAILURE;
+  }
+  size_t bytes = pgn.view().size();
+
+  CountingVisitor counter;
+  double seconds = best_of([&] {
+    counter = CountingVisitor();
+    pgn::StreamParser parser(pgn.view());
+    parser.readGames(counter);
+  });
+  printf("parse %zu games, %zu plies, %.1f MB of PGN\n", counter.games,
+         counter.plies, bytes / 1e6);
+  report("pgn::StreamParser (per game)", counter.games, seconds,
+         bytes / counter.games);
+
+  // Everything a build does per game, up to the default ply limit.
+  seconds = best_of([&] {
+    PGBuilder pg_builder;
+    pg_builder.max_plies = 16;
+    pgn::StreamParser parser(pgn.view());
+    parser.readGames(pg_builder);
+  });
+  report("PGBuilder (per game)", counter.games, seconds,
+         bytes / counter.games);
+  return EXIT_SUCCESS;
+}
+
+// Replay every game, making the move `resolve(board, game, ply)` gives.
+template <typename F>
+static size_t replay(const vector<vector<string>> &games, F resolve) {
+  size_t plies = 0;
+  Board board;
+  for (size_t g = 0; g < games.size(); g++) {
+    board.setFen(constants::STARTPOS);
+    for (size_t i = 0; i < games[g].size(); i++) {
+      board.makeMove(resolve(board, g, i));
+      plies++;
+    }
+  }
+  return plies;
+}
+
+// SAN that resolve_san must reject, in the position given by the FEN.
+static const struct {
+  const char *fen;
+  const char *san;
+} BAD_SAN[] = {
+    // Pawn pushes to the mover's own back rank.
+    {"4k3/8/8/8/8/8/P7/4K3 w - - 0 1", "a1"},
+    {"4k3/7p/8/8/8/8/8/4K3 b - - 0 1", "h8"},
+};
+
+static int bench_san(const char *path, size_t max_games) {
+  BenchPgn pgn;
+  if (!pgn.open(path)) {
+    return EXIT_FAILURE;
+  }
+  vector<vector<string>> games;
+  vector<vector<Move>> expected;
+  load_games(pgn.view(), max_games, games, expected);
+
+  // Replaying the known moves is common to both, so it's subtracted.
+  size_t plies = 0;
+  double base = best_of([&] {
+    plies = replay(games, [&](const Board &, size_t g, size_t i) {
+      return expected[g][i];
+    });
+  });
+  printf("resolve SAN of %zu plies in %zu games\n", plies, games.size());
+
+  double seconds = best_of([&] {
+    replay(games, [&](const Board &board, size_t g, size_t i) {
+      return uci::parseSan(board, games[g][i]);
+    });
+  });
+  report("uci::parseSan", plies, seconds - base, 0);
+
+  size_t mismatches = 0;
+  seconds = best_of([&] {
+    replay(games, [&](const Board &board, size_t g, size_t i) {
+      Move move = Move::NO_MOVE;
+      if (resolve_san(board, games[g][i], move) != SanStatus::Ok ||
+          move != expected[g][i]) {
+        mismatches++;
+      }
+      return expected[g][i];
+    });
+  });
+  report("resolve_san", plies, seconds - base, 0);
+
+  if (mismatches > 0) {
+    fprintf(stderr, "resolve_san differs from parseSan on %zu plies\n",
+            mismatches);
+    return EXIT_FAILURE;
+  }
+  for (const auto &bad : BAD_SAN) {
+    Board board(bad.fen);
+    Move move = Move::NO_MOVE;
+    if (resolve_san(board, bad.san, move) == SanStatus::Ok) {
+      fprintf(stderr, "resolve_san accepts %s in %s\n", bad.san, bad.fen);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static int bench_board(const char *path, size_t max_games) {
+  BenchPgn pgn;
+  if (!pgn.open(path)) {
+    return EXIT_FAILURE;
+  }
+  vector<vector<string>> sans;
+  vector<vector<Move>> games;
+  load_games(pgn.view(), max_games, sans, games);
+
+  // The hashes are summed so that none of the work can be left out.
+  size_t plies = 0;
+  uint64_t sum = 0;
+  Board board;
+  double seconds = best_of([&] {
+    plies = 0;
+    for (auto &game : games) {
+      board.setFen(constants::STARTPOS);
+      for (auto &move : game) {
+        board.makeMove(move);
+        sum += board.hash();
+        plies++;
+      }
+    }
+  });
+  printf("make %zu plies of %zu games\n", plies, games.size());
+  report("Board::makeMove + hash", plies, seconds, 0);
+
+  // What the incremental hash saves: the full zobrist of every position.
+  seconds = best_of([&] {
+    for (auto &game : games) {
+      board.setFen(constants::STARTPOS);
+      for (auto &move : game) {
+        board.makeMove(move);
+        sum += board.zobrist();
+      }
+    }
+  });
+  report("Board::makeMove + zobrist", plies, seconds, 0);
+
+  uint16_t encoded_sum = 0;
+  seconds = best_of([&] {
+    for (auto &game : games) {
+      for (auto &move : game) {
+        encoded_sum += encode_move(move);
+      }
+    }
+  });
+  report("encode_move", plies, seconds, 0);
+
+  // Keeps the sums alive.
+  if (sum == 0 && encoded_sum == 0 && plies > 0) {
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+// A sorted, reduced book of about `n` entries.
+static vector<struct BookEntry> make_book(size_t n) {
+  auto entries = make_entries(n, 42);
+  sort_and_reduce(entries, 1);
+  return entries;
+}
+
+static int bench_io(size_t n) {
+  auto entries = make_book(n);
+  printf("write and read %zu entries\n", entries.size());
+
+  string path = (filesystem::temp_directory_path() /
+                 ("polyglot-bench-" + to_string(getpid()) + ".bin"))
+                    .string();
+  // Truncating the last run's file costs more than writing a new one, so
+  // every run starts from scratch.
+  double seconds = best_of([&] {
+    filesystem::remove(path);
+    ofstream strm(path, ios::binary);
+    write_pg_file(strm, entries);
+  });
+  report("write_pg_file", entries.size(), seconds, sizeof(struct BookEntry));
+
+  seconds = best_of([&] {
+    filesystem::remove(path);
+    PGWriter writer;
+    writer.open(path);
+    writer.write(entries.data(), entries.size());
+    writer.close();
+  });
+  report("PGWriter", entries.size(), seconds, sizeof(struct BookEntry));
+
+  // Each codec on its own, in cache sized blocks.
+  const size_t block = 4096;
+  vector<char> encoded(block * sizeof(struct BookEntry));
+  vector<struct BookEntry> decoded(block);
+  EntryCodec fastest = entry_codec();
+  // The last block, as the scalar codec encodes it, to check the others by.
+  // It's short when the book isn't a whole number of blocks.
+  size_t last = entries.empty() ? 0 : (entries.size() - 1) / block * block;
+  size_t last_count = entries.size() - last;
+  vector<char> expected(last_count * sizeof(struct BookEntry));
+  set_entry_codec(EntryCodec::Scalar);
+  encode_entries(entries.data() + last, last_count, expected.data());
+  vector<struct BookEntry> last_entries(entries.begin() + last, entries.end());
+  bool codecs_agree = true;
+  for (auto codec : {EntryCodec::Scalar, EntryCodec::Ssse3, EntryCodec::Avx2}) {
+    if (!set_entry_codec(codec)) {
+      continue;
+    }
+    seconds = best_of([&] {
+      for (size_t start = 0; start < entries.size(); start += block) {
+        size_t count = min(block, entries.size() - start);
+        encode_entries(entries.data() + start, count, encoded.data());
+        decode_entries(encoded.data(), count, decoded.data());
+      }
+    });
+    report(("encode+decode " + string(entry_codec_name(codec))).c_str(),
+           entries.size(), seconds, sizeof(struct BookEntry));
+    codecs_agree =
+        codecs_agree &&
+        equal(expected.begin(), expected.end(), encoded.begin()) &&
+        same_entries(vector<struct BookEntry>(decoded.begin(),
+                                              decoded.begin() + last_count),
+                     last_entries);
+  }
+  set_entry_codec(fastest);
+  if (!codecs_agree) {
+    fprintf(stderr, "the entry codecs disagree\n");
+    filesystem::remove(path);
+    return EXIT_FAILURE;
+  }
+
+  vector<struct BookEntry> read_entries;
+  seconds = best_of([&] {
+    ifstream strm(path, ios::binary);
+    read_entries = read_pg_file(strm);
+  });
+  report("read_pg_file", entries.size(), seconds, sizeof(struct BookEntry));
+  if (!same_entries(read_entries, entries)) {
+    fprintf(stderr, "read_pg_file gave back different entries\n");
+    filesystem::remove(path);
+    return EXIT_FAILURE;
+  }
+
+  seconds = best_of([&] {
+    PolyglotFile book;
+    book.open(path, MADV_SEQUENTIAL);
+    read_entries = vector<struct BookEntry>();
+    book.decode_all(read_entries);
+  });
+  report("PolyglotFile::decode_all", entries.size(), seconds,
+         sizeof(struct BookEntry));
+  filesystem::remove(path);
+
+  if (!same_entries(read_entries, entries)) {
+    fprintf(stderr, "PolyglotFile gave back different entries\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int bench_codegen(size_t n) {
+  auto entries = make_book(n);
+  printf("generate code for %zu entries\n", entries.size());
+
+  struct CodegenOptions opts = {.min_position_frequency = 2,
+                                 .min_move_frequency = 2,
+                                 .top_k = 4,
+                                 .format = CodegenFormat::Gleam,
+                                 .shards = 1,
+                                 .module = ""};
+  for (auto [name, format] : {pair("write_table gleam", CodegenFormat::Gleam),
+                               pair("write_table etf", CodegenFormat::Etf),
+                               pair("write_table case", CodegenFormat::Case),
+                               pair("write_table bits", CodegenFormat::Bits)}) {
+    opts.format = format;
+    double seconds = time_it([&] {
+      ostringstream strm;
+      write_table(strm, "", entries, opts);
+    });
+    report(name, entries.size(), seconds, sizeof(struct BookEntry));
+  }
+  return EXIT_SUCCESS;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: polyglot-bench all\n"
+                  "       polyglot-bench parse [pgn]\n"
+                  "       polyglot-bench san [pgn [games]]\n"
+                  "       polyglot-bench board [pgn [games]]\n"
+                  "       polyglot-bench sort [entries]\n"
+                  "       polyglot-bench io [entries]\n"
+                  "       polyglot-bench codegen [entries]\n"
+                  "Without a PGN, or with -, the PGN benchmarks run on "
+                  "generated games.\n");
+}
+
+int main(int argc, char **argv) {
+  // Keep the numbers readable.
+  SET_LOG_LEVEL(tinylogger::LogLevel::Warning);
+
+  if (argc < 2) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  string bench = argv[1];
+  const char *path = argc > 2 ? argv[2] : nullptr;
+  size_t games = argc > 3 ? strtoull(argv[3], nullptr, 10) : 100000;
+  size_t n = argc > 2 ? strtoull(argv[2], nullptr, 10) : 0;
+
+  if (bench == "all") {
+    int failed = 0;
+    failed |= bench_parse(nullptr);
+    failed |= bench_san(nullptr, games);
+    failed |= bench_board(nullptr, games);
+    failed |= bench_sort(20000000);
+    failed |= bench_io(20000000);
+    failed |= bench_codegen(20000000);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  if (bench == "parse") {
+    return bench_parse(path);
+  }
+  if (bench == "san") {
+    return bench_san(path, games);
+  }
+  if (bench == "board") {
+    return bench_board(path, games);
+  }
+  if (bench == "sort") {
+    return bench_sort(n > 0 ? n : 20000000);
+  }
+  if (bench == "io") {
+    return bench_io(n > 0 ? n : 20000000);
+  }
+  if (bench == "codegen") {
+    return bench_codegen(n > 0 ? n : 20000000);
+  }
+  usage();
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,195 @@
+#ifndef _BOUNDED_QUEUE_H_
+#define _BOUNDED_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+using namespace std;
+
+// How a queue was used, to tell which side of it had to wait.
+struct QueueStats {
+  size_t capacity = 0;
+  uint64_t pushes = 0;
+  // Items in the queue right after a push, averaged over all pushes.
+  double mean_depth = 0;
+  size_t max_depth = 0;
+  // Time producers waited for room and consumers waited for items, summed
+  // over all threads.
+  double push_stall_seconds = 0;
+  double pop_stall_seconds = 0;
+};
+
+/*
+ * A bounded lock-free queue for any number of producers and consumers, on a
+ * ring of cells that each carry a sequence number telling whose turn the
+ * cell is (Vyukov's). Producers and consumers only contend on their own end
+ * of the ring.
+ *
+ * `push` and `pop` block when the queue is full or empty, by waiting on the
+ * sequence number of the cell they want, so a stalled thread sleeps instead
+ * of spinning. The time they spend blocked is counted.
+ */
+template <typename T> class BoundedQueue {
+public:
+  // The capacity is rounded up to a power of two.
+  explicit BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mask = size - 1;
+    cells = make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; i++) {
+      cells[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // Move `value` into the queue, unless it's full.
+  bool try_push(T &value) {
+    size_t pos = tail.load(memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, memory_order_release);
+    cell->sequence.notify_all();
+
+    // Consumers may have moved past this push already.
+    size_t popped = head.load(memory_order_relaxed);
+    size_t depth = popped < pos + 1 ? pos + 1 - popped : 0;
+    pushes.fetch_add(1, memory_order_relaxed);
+    depth_sum.fetch_add(depth, memory_order_relaxed);
+    size_t max = max_depth.load(memory_order_relaxed);
+    while (depth > max &&
+           !max_depth.compare_exchange_weak(max, depth,
+                                            memory_order_relaxed)) {
+    }
+    return true;
+  }
+
+  // Move the oldest item into `value`, unless the queue is empty.
+  bool try_pop(T &value) {
+    size_t pos = head.load(memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->value);
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    cell->sequence.notify_all();
+    return true;
+  }
+
+  // Move `value` into the queue, waiting for room if it's full.
+  void push(T &value) {
+    if (try_push(value)) {
+      return;
+    }
+    auto start = chrono::steady_clock::now();
+    do {
+      // The cell the next push goes to frees up once its sequence number
+      // moves on.
+      size_t pos = tail.load(memory_order_relaxed);
+      auto &sequence = cells[pos & mask].sequence;
+      size_t seen = sequence.load(memory_order_acquire);
+      if ((intptr_t)seen - (intptr_t)pos < 0) {
+        sequence.wait(seen, memory_order_acquire);
+      }
+    } while (!try_push(value));
+    push_stall_ns.fetch_add(elapsed_ns(start), memory_order_relaxed);
+  }
+
+  // Move the oldest item into `value`, waiting for one if the queue is
+  // empty.
+  void pop(T &value) {
+    if (try_pop(value)) {
+      return;
+    }
+    auto start = chrono::steady_clock::now();
+    do {
+      size_t pos = head.load(memory_order_relaxed);
+      auto &sequence = cells[pos & mask].sequence;
+      size_t seen = sequence.load(memory_order_acquire);
+      if ((intptr_t)seen - (intptr_t)(pos + 1) < 0) {
+        sequence.wait(seen, memory_order_acquire);
+      }
+    } while (!try_pop(value));
+    pop_stall_ns.fetch_add(elapsed_ns(start), memory_order_relaxed);
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  struct QueueStats stats() const {
+    struct QueueStats stats;
+    stats.capacity = capacity();
+    stats.pushes = pushes.load(memory_order_relaxed);
+    if (stats.pushes > 0) {
+      stats.mean_depth =
+          (double)depth_sum.load(memory_order_relaxed) / stats.pushes;
+    }
+    stats.max_depth = max_depth.load(memory_order_relaxed);
+    stats.push_stall_seconds = push_stall_ns.load(memory_order_relaxed) / 1e9;
+    stats.pop_stall_seconds = pop_stall_ns.load(memory_order_relaxed) / 1e9;
+    return stats;
+  }
+
+private:
+  struct Cell {
+    atomic<size_t> sequence;
+    T value;
+  };
+
+  static uint64_t elapsed_ns(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  unique_ptr<Cell[]> cells;
+  size_t mask;
+
+  // Each end on its own cache line, so producers and consumers don't
+  // invalidate each other's.
+  alignas(64) atomic<size_t> head = 0;
+  alignas(64) atomic<size_t> tail = 0;
+
+  alignas(64) atomic<uint64_t> pushes = 0;
+  atomic<uint64_t> depth_sum = 0;
+  atomic<size_t> max_depth = 0;
+  atomic<uint64_t> push_stall_ns = 0;
+  atomic<uint64_t> pop_stall_ns = 0;
+};
+
+#endif /* _BOUNDED_QUEUE_H_ */
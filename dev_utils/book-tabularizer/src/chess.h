@@ -3925,11 +3925,31 @@ namespace detail {
  */
 class StringBuffer {
    public:
-    bool empty() const noexcept { return index_ == 0; }
+    bool empty() const noexcept { return index_ == 0 && view_.empty(); }
 
-    void clear() noexcept { index_ = 0; }
+    void clear() noexcept {
+        index_ = 0;
+        view_  = {};
+    }
+
+    std::string_view get() const noexcept {
+        return view_.empty() ? std::string_view(buffer_.data(), index_) : view_;
+    }
+
+    /**
+     * @brief Refer to a token in the input instead of copying it, the
+     * caller has to guarantee that the input outlives the token.
+     * @param token
+     */
+    bool assign(std::string_view token) noexcept {
+        if (token.size() > static_cast<std::size_t>(N)) {
+            return false;
+        }
 
-    std::string_view get() const noexcept { return std::string_view(buffer_.data(), index_); }
+        view_ = token;
+
+        return true;
+    }
 
     bool add(char c) {
         if (index_ >= N) {
@@ -3950,6 +3970,8 @@ class StringBuffer {
     std::array<char, N> buffer_ = {};
 
     std::size_t index_ = 0;
+
+    std::string_view view_ = {};
 };
 
 /**
@@ -3963,13 +3985,19 @@ class StreamBuffer {
     using BufferType               = std::array<char, N * N>;
 
    public:
-    StreamBuffer(std::istream &stream) : stream_(stream) {}
+    StreamBuffer(std::istream &stream) : stream_(&stream) {}
+
+    // Read directly from memory (e.g. a mapped file), nothing is copied
+    StreamBuffer(std::string_view data)
+        : data_(data.data()), bytes_read_(static_cast<std::streamsize>(data.size())) {}
+
+    bool isMemoryBacked() const noexcept { return stream_ == nullptr; }
 
     // Get the current character, skip carriage returns
     std::optional<char> some() {
         while (true) {
             if (buffer_index_ < bytes_read_) {
-                const auto c = buffer_[buffer_index_];
+                const auto c = data_[buffer_index_];
 
                 if (c == '\r') {
                     ++buffer_index_;
@@ -4018,10 +4046,16 @@ class StreamBuffer {
     }
 
     bool fill() {
+        // the whole input is already available
+        if (isMemoryBacked()) {
+            return buffer_index_ < bytes_read_;
+        }
+
         buffer_index_ = 0;
 
-        stream_.read(buffer_.data(), N * N);
-        bytes_read_ = stream_.gcount();
+        stream_->read(buffer_.data(), N * N);
+        bytes_read_ = stream_->gcount();
+        data_       = buffer_.data();
 
         return bytes_read_ > 0;
     }
@@ -4036,23 +4070,84 @@ class StreamBuffer {
 
     char peek() {
         if (buffer_index_ + 1 >= bytes_read_) {
-            return stream_.peek();
+            return isMemoryBacked() ? std::char_traits<char>::eof() : stream_->peek();
         }
 
-        return buffer_[buffer_index_ + 1];
+        return data_[buffer_index_ + 1];
     }
 
     std::optional<char> current() {
         if (buffer_index_ >= bytes_read_) {
-            return fill() ? std::optional<char>(buffer_[buffer_index_]) : std::nullopt;
+            return fill() ? std::optional<char>(data_[buffer_index_]) : std::nullopt;
         }
 
-        return buffer_[buffer_index_];
+        return data_[buffer_index_];
+    }
+
+    /**
+     * @brief The run of non-space characters at the cursor, viewed in place.
+     * Only available when memory backed, since the view has to stay valid
+     * after the cursor moves on, empty otherwise.
+     */
+    std::string_view token() const noexcept {
+        if (!isMemoryBacked()) {
+            return {};
+        }
+
+        auto end = buffer_index_;
+
+        while (end < bytes_read_) {
+            const auto c = data_[end];
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                break;
+            }
+
+            ++end;
+        }
+
+        return std::string_view(data_ + buffer_index_, static_cast<std::size_t>(end - buffer_index_));
+    }
+
+    /**
+     * @brief Move the cursor past a token returned by token()
+     */
+    void skip(std::size_t n) noexcept { buffer_index_ += static_cast<std::streamsize>(n); }
+
+    /**
+     * @brief Move the cursor to the next '[' that starts a line outside of a
+     * comment, i.e. the next header, without looking at anything in between.
+     * The cursor itself counts as the start of a line.
+     * @return false if the input ended first
+     */
+    bool skipToHeader() {
+        bool line_start = true;
+        bool in_comment = false;
+
+        while (buffer_index_ < bytes_read_ || fill()) {
+            for (; buffer_index_ < bytes_read_; ++buffer_index_) {
+                const auto c = data_[buffer_index_];
+
+                if (in_comment) {
+                    in_comment = c != '}';
+                    line_start = false;
+                } else if (c == '{') {
+                    in_comment = true;
+                } else if (c == '[' && line_start) {
+                    return true;
+                } else {
+                    line_start = c == '\n' || (line_start && (c == ' ' || c == '\t' || c == '\r'));
+                }
+            }
+        }
+
+        return false;
     }
 
    private:
-    std::istream &stream_;
+    std::istream *stream_ = nullptr;
     BufferType buffer_;
+    const char *data_             = nullptr;
     std::streamsize bytes_read_   = 0;
     std::streamsize buffer_index_ = 0;
 };
@@ -4166,6 +4261,13 @@ class StreamParser {
    public:
     StreamParser(std::istream &stream) : stream_buffer(stream) {}
 
+    /**
+     * @brief Parse PGNs held in memory, e.g. a mapped file. Moves are passed to
+     * the visitor as views into `data`, which has to outlive the parser.
+     * @param data
+     */
+    StreamParser(std::string_view data) : stream_buffer(data) {}
+
     StreamParserError readGames(Visitor &vis) {
         visitor = &vis;
 
@@ -4322,10 +4424,26 @@ class StreamParser {
         }
     }
 
+    void skipBody() {
+        const auto found_header = stream_buffer.skipToHeader();
+
+        onEnd();
+
+        // we're already at the next header
+        if (found_header) dont_advance_after_body = true;
+    }
+
     void processBody() {
         auto is_termination_symbol = false;
         auto has_comment           = false;
 
+        // the visitor doesn't care about the rest of this game, so don't even
+        // tokenize it
+        if (visitor->skip()) {
+            skipBody();
+            return;
+        }
+
     start:
         /*
         Skip first move number or game termination
@@ -4388,6 +4506,11 @@ class StreamParser {
         }
 
         while (auto cd = stream_buffer.some()) {
+            if (visitor->skip()) {
+                skipBody();
+                break;
+            }
+
             // Pgn are build up in the following way.
             // {move_number} {move} {comment} {move} {comment} {move_number} ...
             // So we need to skip the move_number then start reading the move, then save the comment
@@ -4513,6 +4636,22 @@ class StreamParser {
     }
 
     bool parseMove() {
+        // the move can be viewed in place, no need to copy it
+        if (move.empty()) {
+            const auto token = stream_buffer.token();
+
+            if (!token.empty()) {
+                if (!move.assign(token)) {
+                    error = StreamParserError::ExceededMaxStringLength;
+                    return true;
+                }
+
+                stream_buffer.skip(token.size());
+
+                return parseMoveAppendix();
+            }
+        }
+
         // reading move
         while (auto c = stream_buffer.some()) {
             if (is_space(*c)) {
@@ -0,0 +1,540 @@
+#include "codegen.h"
+#include "tinylogger.h"
+#include "util.h"
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+
+PositionSelector::PositionSelector(const struct CodegenOptions &opts,
+                                   PositionFn emit)
+    : opts(opts), emit(std::move(emit)) {}
+
+void PositionSelector::add(const struct BookEntry &be) {
+  if (!moves.empty() && be.key != moves[0].key) {
+    select();
+  }
+  moves.push_back(be);
+  position_frequency += be.weight;
+}
+
+void PositionSelector::finish() {
+  if (!moves.empty()) {
+    select();
+  }
+  LOG_DEBUG("got %ld positions\n", positions_seen);
+  LOG_DEBUG("kept %ld positions\n", positions_kept);
+  LOG_DEBUG("kept %ld moves\n", moves_kept);
+}
+
+void PositionSelector::select() {
+  positions_seen++;
+  uint64_t key = moves[0].key;
+  // Skip this position altogether if it's really infrequent.
+  bool keep = position_frequency >= opts.min_position_frequency;
+  position_frequency = 0;
+  if (!keep) {
+    moves.clear();
+    return;
+  }
+
+  // Only the top k need to be in order, so the rest are just partitioned
+  // off. Ties go to the smaller move, so the output doesn't depend on how
+  // the sort happens to order them.
+  auto heavier = [](const struct BookEntry &a, const struct BookEntry &b) {
+    return a.weight != b.weight ? a.weight > b.weight : a.move < b.move;
+  };
+  size_t keep_k = min(moves.size(), (size_t)opts.top_k);
+  if (keep_k < moves.size()) {
+    nth_element(moves.begin(), moves.begin() + keep_k, moves.end(), heavier);
+  }
+  sort(moves.begin(), moves.begin() + keep_k, heavier);
+
+  // Heaviest first, so the moves that are too light are all at the end.
+  size_t num_kept = 0;
+  while (num_kept < keep_k &&
+         moves[num_kept].weight >= opts.min_move_frequency) {
+    num_kept++;
+  }
+  moves.resize(num_kept);
+  if (num_kept > 0) {
+    positions_kept++;
+    moves_kept += num_kept;
+    emit(key, moves);
+  }
+  moves.clear();
+}
+
+TableWriter::TableWriter(ostream &strm, const struct CodegenOptions &opts)
+    : strm(strm),
+      selector(opts, [this](uint64_t key,
+                            const vector<struct BookEntry> &moves) {
+        write_position(key, moves);
+      }) {}
+
+TableWriter::~TableWriter() {}
+
+bool TableWriter::finish() {
+  selector.finish();
+  bool ok = write_end();
+  if (!strm.good()) {
+    LOG_ERROR("could not write the table\n");
+    return false;
+  }
+  return ok;
+}
+
+static const char *GLEAM_MOVES_TYPE = "List(#(Int, Int))";
+
+// Every Gleam table module has a `load` function giving the lookup that
+// `tablebase.load` uses, whatever its format. For those with a
+// `lookup_move` function, that's all it is.
+static const char *GLEAM_LOAD_LOOKUP_MOVE =
+    "/// The lookup that `tablebase.load` uses.\n"
+    "pub fn load() -> fn(Int) -> List(#(Int, Int)) {\n"
+    "  lookup_move\n"
+    "}\n";
+
+GleamTableWriter::GleamTableWriter(ostream &strm,
+                                   const struct CodegenOptions &opts)
+    : TableWriter(strm, opts) {
+  strm << "import gleam/dict\nimport gleam/result\n\n";
+  strm << "pub const table = [";
+}
+
+// Append `value` in lowercase hex with a 0x prefix.
+static void append_hex(string &out, uint64_t value) {
+  char buf[2 + 16];
+  buf[0] = '0';
+  buf[1] = 'x';
+  auto result = to_chars(buf + 2, buf + sizeof(buf), value, 16);
+  out.append(buf, result.ptr);
+}
+
+// Append the moves of a position as a Gleam list of #(move, weight).
+static void append_gleam_moves(string &out,
+                               const vector<struct BookEntry> &moves) {
+  out.push_back('[');
+  for (size_t i = 0; i < moves.size(); i++) {
+    // The last move has no comma. Over a large amount of tables, this is
+    // bound to save a few KB to a few MB.
+    if (i > 0) {
+      out.push_back(',');
+    }
+    out.append("#(");
+    append_hex(out, moves[i].move);
+    out.push_back(',');
+    append_hex(out, moves[i].weight);
+    out.push_back(')');
+  }
+  out.push_back(']');
+}
+
+// Append a position of a Gleam table, with a trailing comma.
+static void append_gleam_position(string &out, uint64_t key,
+                                  const vector<struct BookEntry> &moves) {
+  out.append("#(");
+  append_hex(out, key);
+  out.push_back(',');
+  append_gleam_moves(out, moves);
+  // The last position keeps its trailing comma (in the outer list), which
+  // is the only unnecessary one in the list.
+  out.append("),");
+}
+
+void GleamTableWriter::write_position(uint64_t key,
+                                      const vector<struct BookEntry> &moves) {
+  buffer.clear();
+  append_gleam_position(buffer, key, moves);
+  strm.write(buffer.data(), buffer.size());
+}
+
+bool GleamTableWriter::write_end() {
+  strm << "]\n\n";
+  strm << "/// The lookup that `tablebase.load` uses, from the table turned "
+          "into a dict.\n"
+          "pub fn load() -> fn(Int) -> List(#(Int, Int)) {\n"
+          "  let positions = dict.from_list(table)\n"
+          "  fn(hash) { dict.get(positions, hash) |> result.unwrap([]) }\n"
+          "}\n";
+  return true;
+}
+
+// Tags of the external term format that we use.
+static const uint8_t ETF_VERSION = 131;
+static const uint8_t ETF_SMALL_INTEGER = 97;
+static const uint8_t ETF_INTEGER = 98;
+static const uint8_t ETF_SMALL_TUPLE = 104;
+static const uint8_t ETF_NIL = 106;
+static const uint8_t ETF_LIST = 108;
+static const uint8_t ETF_SMALL_BIG = 110;
+static const uint8_t ETF_MAP = 116;
+
+static void append_u32(string &out, uint32_t value) {
+  value = swap32(value);
+  out.append((const char *)&value, sizeof(value));
+}
+
+// Append `value` the way `term_to_binary` encodes it, in as few bytes as
+// the format allows.
+static void append_etf_integer(string &out, uint64_t value) {
+  if (value <= UINT8_MAX) {
+    out.push_back(ETF_SMALL_INTEGER);
+    out.push_back((char)value);
+  } else if (value <= INT32_MAX) {
+    out.push_back(ETF_INTEGER);
+    append_u32(out, value);
+  } else {
+    // A bignum, its bytes least significant first.
+    uint8_t num_bytes = 0;
+    for (uint64_t rest = value; rest > 0; rest >>= 8) {
+      num_bytes++;
+    }
+    out.push_back(ETF_SMALL_BIG);
+    out.push_back(num_bytes);
+    out.push_back(0); // positive
+    for (uint8_t i = 0; i < num_bytes; i++) {
+      out.push_back((char)(value >> (8 * i)));
+    }
+  }
+}
+
+EtfTableWriter::EtfTableWriter(ostream &strm,
+                               const struct CodegenOptions &opts)
+    : TableWriter(strm, opts) {
+  strm.put(ETF_VERSION);
+  strm.put(ETF_MAP);
+  size_pos = strm.tellp();
+  buffer.clear();
+  append_u32(buffer, 0);
+  strm.write(buffer.data(), buffer.size());
+}
+
+void EtfTableWriter::write_position(uint64_t key,
+                                    const vector<struct BookEntry> &moves) {
+  buffer.clear();
+  append_etf_integer(buffer, key);
+  buffer.push_back(ETF_LIST);
+  append_u32(buffer, moves.size());
+  for (auto &be : moves) {
+    buffer.push_back(ETF_SMALL_TUPLE);
+    buffer.push_back(2);
+    append_etf_integer(buffer, be.move);
+    append_etf_integer(buffer, be.weight);
+  }
+  buffer.push_back(ETF_NIL);
+  strm.write(buffer.data(), buffer.size());
+}
+
+bool EtfTableWriter::write_end() {
+  if (size_pos == streampos(-1)) {
+    LOG_ERROR("can't fill in the size of the table, the output isn't "
+              "seekable\n");
+    return false;
+  }
+  buffer.clear();
+  append_u32(buffer, selector.positions_kept);
+  auto end = strm.tellp();
+  strm.seekp(size_pos);
+  strm.write(buffer.data(), buffer.size());
+  strm.seekp(end);
+  return true;
+}
+
+static const size_t CASE_LEAF_POSITIONS = 1 << 10;
+
+CaseLookupWriter::CaseLookupWriter(ostream &strm) : strm(strm) {}
+
+void CaseLookupWriter::write_position(uint64_t key,
+                                      const vector<struct BookEntry> &moves) {
+  buffer.clear();
+  if (leaf_size == 0) {
+    buffer.append("fn lookup_" + to_string(leaf_keys.size()) +
+                  "(hash: Int) -> " + GLEAM_MOVES_TYPE +
+                  " {\n  case hash {\n");
+    leaf_keys.push_back(key);
+  }
+  buffer.append("    ");
+  append_hex(buffer, key);
+  buffer.append(" -> ");
+  append_gleam_moves(buffer, moves);
+  buffer.push_back('\n');
+  strm.write(buffer.data(), buffer.size());
+  if (++leaf_size == CASE_LEAF_POSITIONS) {
+    close_leaf();
+  }
+}
+
+void CaseLookupWriter::close_leaf() {
+  if (leaf_size > 0) {
+    strm << "    _ -> []\n  }\n}\n\n";
+    leaf_size = 0;
+  }
+}
+
+void CaseLookupWriter::write_tree(size_t lo, size_t hi, int depth) {
+  string indent(2 * depth, ' ');
+  if (hi - lo == 1) {
+    strm << indent << "lookup_" << lo << "(hash)\n";
+    return;
+  }
+  // Keys under the first key of the middle function are in the ones
+  // before it.
+  size_t mid = lo + (hi - lo) / 2;
+  buffer.clear();
+  append_hex(buffer, leaf_keys[mid]);
+  strm << indent << "case hash < " << buffer << " {\n";
+  strm << indent << "  True ->\n";
+  write_tree(lo, mid, depth + 2);
+  strm << indent << "  False ->\n";
+  write_tree(mid, hi, depth + 2);
+  strm << indent << "}\n";
+}
+
+void CaseLookupWriter::write_end() {
+  close_leaf();
+  if (leaf_keys.empty()) {
+    strm << "pub fn lookup_move(_hash: Int) -> " << GLEAM_MOVES_TYPE
+         << " {\n  []\n}\n";
+  } else {
+    strm << "pub fn lookup_move(hash: Int) -> " << GLEAM_MOVES_TYPE
+         << " {\n";
+    write_tree(0, leaf_keys.size(), 1);
+    strm << "}\n";
+  }
+  LOG_DEBUG("split the lookup into %ld functions\n", leaf_keys.size());
+}
+
+CaseTableWriter::CaseTableWriter(ostream &strm,
+                                 const struct CodegenOptions &opts)
+    : TableWriter(strm, opts), lookup(strm) {}
+
+void CaseTableWriter::write_position(uint64_t key,
+                                     const vector<struct BookEntry> &moves) {
+  lookup.write_position(key, moves);
+}
+
+bool CaseTableWriter::write_end() {
+  lookup.write_end();
+  strm << "\n" << GLEAM_LOAD_LOOKUP_MOVE;
+  return true;
+}
+
+BitsTableWriter::BitsTableWriter(ostream &strm,
+                                 const struct CodegenOptions &opts)
+    : TableWriter(strm, opts) {
+  strm << "import gleam/bit_array\nimport gleam/int\nimport gleam/order\n\n";
+  strm << "/// Every kept move as a 12 byte record: the key of its position, "
+          "the move and\n/// its weight. Sorted by key, and the moves of a "
+          "position heaviest first.\n";
+  strm << "fn entries() -> BitArray {\n  <<";
+}
+
+void BitsTableWriter::write_position(uint64_t key,
+                                     const vector<struct BookEntry> &moves) {
+  index.push_back(num_records);
+  buffer.clear();
+  for (auto &be : moves) {
+    buffer.append(num_records == 0 ? "\n    " : ",\n    ");
+    append_hex(buffer, key);
+    buffer.append(":size(64), ");
+    append_hex(buffer, be.move);
+    buffer.append(":size(16), ");
+    append_hex(buffer, be.weight);
+    buffer.append(":size(16)");
+    num_records++;
+  }
+  strm.write(buffer.data(), buffer.size());
+}
+
+bool BitsTableWriter::write_end() {
+  strm << "\n  >>\n}\n\n";
+
+  size_t num_positions = index.size();
+  index.push_back(num_records);
+  strm << "/// The record each position starts at, 4 bytes each, and the "
+          "number of records\n/// at the end.\n";
+  strm << "fn index() -> BitArray {\n  <<";
+  for (size_t i = 0; i < index.size(); i++) {
+    buffer.assign(i == 0 ? "\n    " : ",\n    ");
+    append_hex(buffer, index[i]);
+    buffer.append(":size(32)");
+    strm << buffer;
+  }
+  strm << "\n  >>\n}\n\n";
+
+  strm << "const num_positions = " << num_positions << "\n\n";
+  strm << R"(/// The moves of the position with `hash`, and their weights.
+pub fn lookup_move(hash: Int) -> List(#(Int, Int)) {
+  find(entries(), index(), hash, 0, num_positions)
+}
+
+fn find(
+  entries: BitArray,
+  index: BitArray,
+  hash: Int,
+  lo: Int,
+  hi: Int,
+) -> List(#(Int, Int)) {
+  case lo < hi {
+    False -> []
+    True -> {
+      let mid = { lo + hi } / 2
+      let first = record_at(index, mid)
+      case int.compare(key_at(entries, first), hash) {
+        order.Lt -> find(entries, index, hash, mid + 1, hi)
+        order.Gt -> find(entries, index, hash, lo, mid)
+        order.Eq -> moves_between(entries, first, record_at(index, mid + 1), [])
+      }
+    }
+  }
+}
+
+fn record_at(index: BitArray, position: Int) -> Int {
+  let assert Ok(<<record:size(32)>>) = bit_array.slice(index, position * 4, 4)
+  record
+}
+
+fn key_at(entries: BitArray, record: Int) -> Int {
+  let assert Ok(<<key:size(64)>>) = bit_array.slice(entries, record * 12, 8)
+  key
+}
+
+fn moves_between(
+  entries: BitArray,
+  first: Int,
+  last: Int,
+  acc: List(#(Int, Int)),
+) -> List(#(Int, Int)) {
+  case first < last {
+    False -> acc
+    True -> {
+      let assert Ok(<<_:size(64), move:size(16), weight:size(16)>>) =
+        bit_array.slice(entries, { last - 1 } * 12, 12)
+      moves_between(entries, first, last - 1, [#(move, weight), ..acc])
+    }
+  }
+}
+)";
+  strm << "\n" << GLEAM_LOAD_LOOKUP_MOVE;
+  LOG_DEBUG("packed %ld moves of %ld positions\n", num_records,
+            num_positions);
+  return true;
+}
+
+ShardedGleamWriter::ShardedGleamWriter(ostream &strm, const string &path,
+                                       const struct CodegenOptions &opts)
+    : TableWriter(strm, opts), opts(opts),
+      dir(filesystem::path(path).replace_extension()) {
+  error_code ec;
+  filesystem::create_directories(dir, ec);
+  if (ec) {
+    LOG_ERROR("could not create %s: %s\n", dir.c_str(),
+              ec.message().c_str());
+    failed = true;
+  }
+}
+
+void ShardedGleamWriter::close_shard() {
+  if (shard_strm.is_open()) {
+    shard_lookup->write_end();
+    shard_lookup.reset();
+    failed |= !shard_strm.good();
+    shard_strm.close();
+  }
+}
+
+void ShardedGleamWriter::next_shard() {
+  close_shard();
+  shard++;
+  if (failed) {
+    return;
+  }
+  string path = dir + "/shard_" + to_string(shard) + ".gleam";
+  shard_strm.open(path, ios::binary);
+  if (!shard_strm.is_open()) {
+    LOG_ERROR("could not open file %s\n", path.c_str());
+    failed = true;
+    return;
+  }
+  shard_lookup = make_unique<CaseLookupWriter>(shard_strm);
+}
+
+void ShardedGleamWriter::write_position(
+    uint64_t key, const vector<struct BookEntry> &moves) {
+  // Keys come in order, so shards are filled one after the other. Shards
+  // no key falls in are still written, empty.
+  while (shard < shard_of(key, opts.shards)) {
+    next_shard();
+  }
+  if (failed) {
+    return;
+  }
+  shard_lookup->write_position(key, moves);
+}
+
+bool ShardedGleamWriter::write_end() {
+  while (shard + 1 < opts.shards) {
+    next_shard();
+  }
+  close_shard();
+  if (failed) {
+    LOG_ERROR("could not write the table shards\n");
+    return false;
+  }
+
+  strm << "//// Positions and their moves, split into " << opts.shards
+       << " shards by key.\n\n";
+  for (uint32_t i = 0; i < opts.shards; i++) {
+    strm << "import " << opts.module << "/shard_" << i << "\n";
+  }
+  strm << "import gleam/int\n";
+  strm << "\n/// The moves of the position with `hash`, and their weights, "
+          "from the shard it\n/// falls in. A shard's module is only loaded "
+          "the first time it's needed.\n";
+  strm << "pub fn lookup_move(hash: Int) -> " << GLEAM_MOVES_TYPE << " {\n";
+  strm << "  case int.bitwise_shift_right(hash, 32) * " << opts.shards
+       << " |> int.bitwise_shift_right(32) {\n";
+  for (uint32_t i = 0; i < opts.shards; i++) {
+    strm << "    " << i << " -> shard_" << i << ".lookup_move(hash)\n";
+  }
+  strm << "    _ -> []\n  }\n}\n";
+  strm << "\n" << GLEAM_LOAD_LOOKUP_MOVE;
+  return true;
+}
+
+unique_ptr<TableWriter> make_table_writer(ostream &strm, const string &path,
+                                          const struct CodegenOptions &opts) {
+  switch (opts.format) {
+  case CodegenFormat::Etf:
+    if (opts.shards > 1) {
+      LOG_WARNING("an ETF table is a single term, it isn't sharded\n");
+    }
+    return make_unique<EtfTableWriter>(strm, opts);
+  case CodegenFormat::Case:
+    if (opts.shards > 1) {
+      return make_unique<ShardedGleamWriter>(strm, path, opts);
+    }
+    return make_unique<CaseTableWriter>(strm, opts);
+  case CodegenFormat::Bits:
+    if (opts.shards > 1) {
+      LOG_WARNING("a packed table isn't sharded\n");
+    }
+    return make_unique<BitsTableWriter>(strm, opts);
+  case CodegenFormat::Gleam:
+  default:
+    if (opts.shards > 1) {
+      return make_unique<ShardedGleamWriter>(strm, path, opts);
+    }
+    return make_unique<GleamTableWriter>(strm, opts);
+  }
+}
+
+bool write_table(ostream &strm, const string &path,
+                 const vector<struct BookEntry> &reduced_entries,
+                 const struct CodegenOptions &opts) {
+  auto writer = make_table_writer(strm, path, opts);
+  for (auto &be : reduced_entries) {
+    writer->add(be);
+  }
+  return writer->finish();
+}
@@ -0,0 +1,282 @@
+#ifndef _CODEGEN_H_
+#define _CODEGEN_H_
+
+#include "polyglot.h"
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+enum class CodegenFormat {
+  // A Gleam module with the table as a constant.
+  Gleam,
+  // The table as an Erlang map, in the external term format.
+  Etf,
+  // A Gleam module with a `lookup_move` function that cases on the key.
+  Case,
+  // A Gleam module with the table packed into binaries, and a
+  // `lookup_move` function that searches them.
+  Bits,
+};
+
+struct CodegenOptions {
+  // Positions whose moves have a smaller total weight are dropped.
+  uint64_t min_position_frequency;
+  // Moves with a smaller weight are dropped.
+  uint16_t min_move_frequency;
+  // At most this many moves are kept per position, the heaviest ones.
+  uint16_t top_k;
+  CodegenFormat format;
+  // Split a Gleam table into this many modules by key. 0 or 1 for a single
+  // module.
+  uint32_t shards;
+  // The Gleam module that a sharded table is written as. Shards are its
+  // submodules.
+  string module;
+};
+
+// A position that is kept, with its kept moves, heaviest first.
+using PositionFn =
+    function<void(uint64_t key, const vector<struct BookEntry> &moves)>;
+
+/*
+ * Picks the positions and moves to keep out of a sorted, reduced stream of
+ * entries, in one pass. Only the moves of the current position are held, so
+ * memory doesn't grow with the book.
+ *
+ * A position is kept if its moves weigh at least `min_position_frequency`
+ * in total, and if any of its `top_k` heaviest moves weighs at least
+ * `min_move_frequency`. Moves of the same weight are ordered by move.
+ */
+class PositionSelector {
+public:
+  PositionSelector(const struct CodegenOptions &opts, PositionFn emit);
+
+  // Entries must come sorted and reduced.
+  void add(const struct BookEntry &be);
+
+  // Hand on the last position.
+  void finish();
+
+  size_t positions_seen = 0;
+  size_t positions_kept = 0;
+  size_t moves_kept = 0;
+
+private:
+  void select();
+
+  const struct CodegenOptions &opts;
+  PositionFn emit;
+  // The moves of the current position. Reused from one position to the
+  // next.
+  vector<struct BookEntry> moves;
+  uint64_t position_frequency = 0;
+};
+
+/*
+ * Writes out the positions a PositionSelector keeps. Entries are added one at
+ * a time, sorted and reduced, and each position is written as soon as it's
+ * complete.
+ */
+class TableWriter {
+public:
+  TableWriter(ostream &strm, const struct CodegenOptions &opts);
+
+  virtual ~TableWriter();
+
+  void add(const struct BookEntry &be) { selector.add(be); }
+
+  // Write out the last position and close the table. Returns false if
+  // writing failed.
+  bool finish();
+
+protected:
+  virtual void write_position(uint64_t key,
+                              const vector<struct BookEntry> &moves) = 0;
+
+  // Close the table, once every position is written.
+  virtual bool write_end() = 0;
+
+  ostream &strm;
+  PositionSelector selector;
+  // One position's worth of output, formatted before it's written.
+  string buffer;
+};
+
+/*
+ * Writes a Gleam module with a `table` constant: a list of positions, each
+ * with its moves and their weights. Its `load` function turns the table
+ * into a dict.
+ */
+class GleamTableWriter : public TableWriter {
+public:
+  GleamTableWriter(ostream &strm, const struct CodegenOptions &opts);
+
+protected:
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  bool write_end();
+};
+
+/*
+ * Writes the table as a single Erlang term, a map of positions to lists of
+ * {move, weight} tuples, which is what `binary_to_term` gives back and what
+ * a Gleam `Dict(Int, List(#(Int, Int)))` is. Nothing has to be compiled or
+ * built up from it at startup.
+ *
+ * The size of the map comes first, so it's filled in once the table is
+ * done, and `strm` has to be seekable.
+ */
+class EtfTableWriter : public TableWriter {
+public:
+  EtfTableWriter(ostream &strm, const struct CodegenOptions &opts);
+
+protected:
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  bool write_end();
+
+private:
+  // Where the size of the map goes.
+  streampos size_pos;
+};
+
+/*
+ * Writes the functions of a Gleam module with a `lookup_move(hash)`
+ * function that gives the moves of a position, or an empty list, by casing
+ * on its key. Nothing is built at startup: the BEAM compiles a case on
+ * integers into a binary search, and the move lists are literals.
+ *
+ * A single case over millions of keys is slow to compile, so keys go into
+ * functions of at most CASE_LEAF_POSITIONS clauses each, in order. Only the
+ * first key of each is kept, and `lookup_move` is a balanced tree of
+ * comparisons against them that picks the function to call.
+ */
+class CaseLookupWriter {
+public:
+  CaseLookupWriter(ostream &strm);
+
+  // Positions must come in order.
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  // Write `lookup_move` itself.
+  void write_end();
+
+private:
+  void close_leaf();
+
+  // Write the tree over the functions [lo, hi).
+  void write_tree(size_t lo, size_t hi, int depth);
+
+  ostream &strm;
+  string buffer;
+  // The first key of each function.
+  vector<uint64_t> leaf_keys;
+  // Clauses in the last function so far.
+  size_t leaf_size = 0;
+};
+
+/*
+ * Writes a Gleam module with a CaseLookupWriter's `lookup_move`, and a
+ * `load` that gives it.
+ */
+class CaseTableWriter : public TableWriter {
+public:
+  CaseTableWriter(ostream &strm, const struct CodegenOptions &opts);
+
+protected:
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  bool write_end();
+
+private:
+  CaseLookupWriter lookup;
+};
+
+/*
+ * Writes a Gleam module with the table packed into two binary literals,
+ * and a `lookup_move(hash)` function that binary searches them. Literal
+ * binaries live outside of process heaps and aren't copied, so the book
+ * takes about as much memory in the engine as the Polyglot file.
+ *
+ * `entries()` holds every kept move as a 12 byte (key, move, weight)
+ * record, sorted by key. `index()` holds the index of the first record of
+ * each position, 4 bytes each, and one past the last record at the end, so
+ * that the search is over positions and each finds its moves right after.
+ * Records are written out as they come, and only the index is held until
+ * the end. `load` gives `lookup_move`.
+ */
+class BitsTableWriter : public TableWriter {
+public:
+  BitsTableWriter(ostream &strm, const struct CodegenOptions &opts);
+
+protected:
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  bool write_end();
+
+private:
+  vector<uint32_t> index;
+  uint32_t num_records = 0;
+};
+
+/*
+ * Writes a Gleam table split into `opts.shards` modules by the high bits of
+ * the keys, so each holds a contiguous range of them, plus a dispatch module
+ * in `strm` whose `lookup_move` calls the `lookup_move` of the right shard.
+ * The BEAM loads a module the first time it's called, so only the shards
+ * that get probed are ever loaded, and the shards can be compiled in
+ * parallel.
+ *
+ * Each shard is a case table, so a lookup is a binary search within its
+ * shard. Shards are written to the directory named after the output,
+ * `data.gleam` going to `data/shard_<i>.gleam`, one at a time as the keys go
+ * by.
+ */
+class ShardedGleamWriter : public TableWriter {
+public:
+  ShardedGleamWriter(ostream &strm, const string &path,
+                     const struct CodegenOptions &opts);
+
+protected:
+  void write_position(uint64_t key, const vector<struct BookEntry> &moves);
+
+  bool write_end();
+
+private:
+  void close_shard();
+
+  // Close the current shard and open the next one.
+  void next_shard();
+
+  const struct CodegenOptions &opts;
+  string dir;
+  // The shard being written, -1 before the first.
+  int64_t shard = -1;
+  ofstream shard_strm;
+  unique_ptr<CaseLookupWriter> shard_lookup;
+  bool failed = false;
+};
+
+// Which of `shards` shards `key` goes to.
+inline uint32_t shard_of(uint64_t key, uint32_t shards) {
+  return ((key >> 32) * shards) >> 32;
+}
+
+// `path` is where the output goes, which only a sharded table needs.
+unique_ptr<TableWriter> make_table_writer(ostream &strm, const string &path,
+                                          const struct CodegenOptions &opts);
+
+/*
+ * Write the book as a table in `opts.format` to `strm`, which is `path`.
+ * `reduced_entries` must be sorted and reduced, which every book we write
+ * already is.
+ */
+bool write_table(ostream &strm, const string &path,
+                 const vector<struct BookEntry> &reduced_entries,
+                 const struct CodegenOptions &opts);
+
+#endif /* _CODEGEN_H_ */
@@ -0,0 +1,140 @@
+#include "entry_codec.h"
+#include "util.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_CODECS
+#endif
+
+// Both ways are the same swap, from `in` to `out`.
+using SwapFn = void (*)(const char *in, size_t count, char *out);
+
+static void swap_scalar(const char *in, size_t count, char *out) {
+  for (size_t i = 0; i < count; i++) {
+    struct BookEntry be;
+    memcpy(&be, in + i * sizeof(struct BookEntry), sizeof(struct BookEntry));
+    be.key = swap64(be.key);
+    be.move = swap16(be.move);
+    be.weight = swap16(be.weight);
+    be.learn = swap32(be.learn);
+    memcpy(out + i * sizeof(struct BookEntry), &be, sizeof(struct BookEntry));
+  }
+}
+
+#ifdef HAVE_X86_CODECS
+// Where each byte of an entry comes from: the key's 8 bytes reversed, then
+// the move's 2, the weight's 2 and the learn's 4.
+#define ENTRY_SHUFFLE 7, 6, 5, 4, 3, 2, 1, 0, 9, 8, 11, 10, 15, 14, 13, 12
+
+__attribute__((target("ssse3"))) static void
+swap_ssse3(const char *in, size_t count, char *out) {
+  const __m128i shuffle = _mm_setr_epi8(ENTRY_SHUFFLE);
+  for (size_t i = 0; i < count; i++) {
+    __m128i entry = _mm_loadu_si128((const __m128i *)in + i);
+    _mm_storeu_si128((__m128i *)out + i, _mm_shuffle_epi8(entry, shuffle));
+  }
+}
+
+__attribute__((target("avx2"))) static void
+swap_avx2(const char *in, size_t count, char *out) {
+  const __m256i shuffle = _mm256_setr_epi8(ENTRY_SHUFFLE, ENTRY_SHUFFLE);
+  const __m256i *src = (const __m256i *)in;
+  __m256i *dst = (__m256i *)out;
+  // Two entries a register, and two registers at a time to keep both load
+  // ports busy.
+  size_t pairs = count / 2;
+  size_t i = 0;
+  for (; i + 2 <= pairs; i += 2) {
+    __m256i a = _mm256_loadu_si256(src + i);
+    __m256i b = _mm256_loadu_si256(src + i + 1);
+    _mm256_storeu_si256(dst + i, _mm256_shuffle_epi8(a, shuffle));
+    _mm256_storeu_si256(dst + i + 1, _mm256_shuffle_epi8(b, shuffle));
+  }
+  for (; i < pairs; i++) {
+    __m256i a = _mm256_loadu_si256(src + i);
+    _mm256_storeu_si256(dst + i, _mm256_shuffle_epi8(a, shuffle));
+  }
+  if (count % 2 != 0) {
+    size_t last = count - 1;
+    swap_scalar(in + last * sizeof(struct BookEntry), 1,
+                out + last * sizeof(struct BookEntry));
+  }
+}
+#endif
+
+static bool supported(EntryCodec codec) {
+#ifdef HAVE_X86_CODECS
+  // Needed as this runs before main, possibly before libgcc set it up.
+  __builtin_cpu_init();
+#endif
+  switch (codec) {
+  case EntryCodec::Scalar:
+    return true;
+#ifdef HAVE_X86_CODECS
+  case EntryCodec::Ssse3:
+    return __builtin_cpu_supports("ssse3");
+  case EntryCodec::Avx2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+static SwapFn swap_fn(EntryCodec codec) {
+  switch (codec) {
+#ifdef HAVE_X86_CODECS
+  case EntryCodec::Ssse3:
+    return swap_ssse3;
+  case EntryCodec::Avx2:
+    return swap_avx2;
+#endif
+  default:
+    return swap_scalar;
+  }
+}
+
+static EntryCodec fastest_codec() {
+  for (auto codec : {EntryCodec::Avx2, EntryCodec::Ssse3}) {
+    if (supported(codec)) {
+      return codec;
+    }
+  }
+  return EntryCodec::Scalar;
+}
+
+// Picked once, before main runs.
+static EntryCodec current_codec = fastest_codec();
+static SwapFn current_swap = swap_fn(current_codec);
+
+EntryCodec entry_codec() { return current_codec; }
+
+bool set_entry_codec(EntryCodec codec) {
+  if (!supported(codec)) {
+    return false;
+  }
+  current_codec = codec;
+  current_swap = swap_fn(codec);
+  return true;
+}
+
+const char *entry_codec_name(EntryCodec codec) {
+  switch (codec) {
+  case EntryCodec::Ssse3:
+    return "ssse3";
+  case EntryCodec::Avx2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+void encode_entries(const struct BookEntry *entries, size_t count,
+                    char *out) {
+  current_swap((const char *)entries, count, out);
+}
+
+void decode_entries(const char *data, size_t count, struct BookEntry *out) {
+  current_swap(data, count, (char *)out);
+}
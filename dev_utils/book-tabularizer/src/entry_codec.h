@@ -0,0 +1,27 @@
+#ifndef _ENTRY_CODEC_H_
+#define _ENTRY_CODEC_H_
+
+#include "polyglot.h"
+
+/*
+ * Polyglot files hold entries big-endian, in the same layout as BookEntry.
+ * Converting between the two reverses each of an entry's fields in place,
+ * which is a single byte shuffle per entry, done on whole blocks of them.
+ */
+enum class EntryCodec { Scalar, Ssse3, Avx2 };
+
+// The codec in use: the fastest one this CPU supports, unless set.
+EntryCodec entry_codec();
+
+// Use `codec` from now on. False if this CPU doesn't support it.
+bool set_entry_codec(EntryCodec codec);
+
+const char *entry_codec_name(EntryCodec codec);
+
+// Encode `count` entries into `out`, which may be `entries` itself.
+void encode_entries(const struct BookEntry *entries, size_t count, char *out);
+
+// Decode `count` entries from `data` into `out`, which may be `data` itself.
+void decode_entries(const char *data, size_t count, struct BookEntry *out);
+
+#endif /* _ENTRY_CODEC_H_ */
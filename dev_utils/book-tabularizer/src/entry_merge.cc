@@ -0,0 +1,137 @@
+#include "entry_merge.h"
+#include "tinylogger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+EntryCursor::~EntryCursor() {}
+
+VectorCursor::VectorCursor(const vector<struct BookEntry> &entries) {
+  pos = entries.data();
+  end = entries.data() + entries.size();
+}
+
+void VectorCursor::refill() {
+  // Everything was there from the start.
+}
+
+RunFileCursor::RunFileCursor(const string &path, size_t buffer_entries)
+    : buffer(max(buffer_entries, (size_t)1)) {
+  file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    LOG_ERROR("could not open run %s: %s\n", path.c_str(), strerror(errno));
+    error = true;
+    return;
+  }
+  refill();
+}
+
+RunFileCursor::~RunFileCursor() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+void RunFileCursor::refill() {
+  size_t n = 0;
+  if (file != nullptr) {
+    n = fread(buffer.data(), sizeof(struct BookEntry), buffer.size(), file);
+    if (n == 0 && ferror(file)) {
+      LOG_ERROR("could not read run: %s\n", strerror(errno));
+      error = true;
+    }
+  }
+  pos = buffer.data();
+  end = buffer.data() + n;
+}
+
+PolyglotCursor::PolyglotCursor(const PolyglotFile &book,
+                               size_t buffer_entries)
+    : book(book), buffer(max(buffer_entries, (size_t)1)) {
+  pos = end = buffer.data();
+  refill();
+}
+
+void PolyglotCursor::refill() {
+  // What was decoded last time won't be read again.
+  book.release(next - (end - buffer.data()), end - buffer.data());
+
+  size_t n = min(buffer.size(), book.size() - next);
+  book.decode(next, n, buffer.data());
+  next += n;
+  pos = buffer.data();
+  end = buffer.data() + n;
+}
+
+bool merge_entries(vector<EntryCursor *> &cursors,
+                   const function<void(const struct BookEntry &)> &emit) {
+  size_t k = cursors.size();
+  if (k == 0) {
+    return true;
+  }
+
+  // Whether cursor `a`'s entry comes before `b`'s. Cursors that are done
+  // come last.
+  auto before = [&](size_t a, size_t b) {
+    if (cursors[a]->done()) {
+      return false;
+    }
+    if (cursors[b]->done()) {
+      return true;
+    }
+    return cursors[a]->peek() < cursors[b]->peek();
+  };
+
+  // Nodes 1 to k - 1 are the inner nodes of the tree, each holding the
+  // cursor that lost there, and k + i is the leaf of cursor i. The overall
+  // winner is kept on the side.
+  vector<size_t> losers(k);
+  function<size_t(size_t)> play = [&](size_t node) -> size_t {
+    if (node >= k) {
+      return node - k;
+    }
+    size_t a = play(2 * node);
+    size_t b = play(2 * node + 1);
+    if (before(b, a)) {
+      swap(a, b);
+    }
+    losers[node] = b;
+    return a;
+  };
+  size_t winner = play(1);
+
+  bool have_curr = false;
+  struct BookEntry curr_be;
+  while (!cursors[winner]->done()) {
+    const struct BookEntry &be = cursors[winner]->peek();
+
+    if (have_curr && curr_be.key == be.key && curr_be.move == be.move) {
+      combine_entries(curr_be, be);
+    } else {
+      if (have_curr) {
+        emit(curr_be);
+      }
+      curr_be = be;
+      have_curr = true;
+    }
+
+    // Only the winner moved, so only its path to the root is replayed.
+    cursors[winner]->advance();
+    for (size_t node = (winner + k) / 2; node > 0; node /= 2) {
+      if (before(losers[node], winner)) {
+        swap(losers[node], winner);
+      }
+    }
+  }
+  // Don't forget the last one
+  if (have_curr) {
+    emit(curr_be);
+  }
+
+  for (auto cursor : cursors) {
+    if (cursor->failed()) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,96 @@
+#ifndef _ENTRY_MERGE_H_
+#define _ENTRY_MERGE_H_
+
+#include "polyglot.h"
+#include <cstdio>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+/*
+ * A sorted, reduced sequence of entries that is read a block at a time.
+ * Subclasses only have to provide the blocks.
+ */
+class EntryCursor {
+public:
+  virtual ~EntryCursor();
+
+  bool done() const { return pos == end; }
+
+  const struct BookEntry &peek() const { return *pos; }
+
+  void advance() {
+    if (++pos == end) {
+      refill();
+    }
+  }
+
+  // Whether reading failed. A failed cursor is also done.
+  bool failed() const { return error; }
+
+protected:
+  // Point [pos, end) at the next block, leaving it empty at the end.
+  virtual void refill() = 0;
+
+  const struct BookEntry *pos = nullptr;
+  const struct BookEntry *end = nullptr;
+  bool error = false;
+};
+
+class VectorCursor : public EntryCursor {
+public:
+  VectorCursor(const vector<struct BookEntry> &entries);
+
+protected:
+  void refill();
+};
+
+/*
+ * Reads a run file of raw, host-endian entries as written by `RunSpiller`.
+ */
+class RunFileCursor : public EntryCursor {
+public:
+  RunFileCursor(const string &path, size_t buffer_entries);
+
+  ~RunFileCursor();
+
+protected:
+  void refill();
+
+private:
+  FILE *file;
+  vector<struct BookEntry> buffer;
+};
+
+/*
+ * Reads the entries of a mapped Polyglot file, decoding a block of them at a
+ * time. Pages of the file that were read are let go of as it goes, so only
+ * a block's worth of it stays resident.
+ */
+class PolyglotCursor : public EntryCursor {
+public:
+  PolyglotCursor(const PolyglotFile &book, size_t buffer_entries);
+
+protected:
+  void refill();
+
+private:
+  const PolyglotFile &book;
+  // The next entry of `book` to decode.
+  size_t next = 0;
+  vector<struct BookEntry> buffer;
+};
+
+/*
+ * Merge sorted, reduced cursors into one sorted, reduced sequence, calling
+ * `emit` for each entry in order. Entries with the same key and move are
+ * combined across cursors. Returns false if any cursor failed.
+ *
+ * The cursors are the leaves of a loser tree, so each entry takes one
+ * comparison per level of the tree to find the next smallest.
+ */
+bool merge_entries(vector<EntryCursor *> &cursors,
+                   const function<void(const struct BookEntry &)> &emit);
+
+#endif /* _ENTRY_MERGE_H_ */
@@ -0,0 +1,178 @@
+#include "entry_sort.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+// Below this, std::sort beats setting up the radix passes.
+static const size_t MIN_RADIX_SORT = 256;
+
+// Buckets of about this many entries (1 MiB) stay in cache while they're
+// radix sorted, which is most of the win over sorting one large array.
+static const size_t BUCKET_ENTRIES = 1 << 16;
+static const int MAX_BUCKET_BITS = 16;
+
+// 2 bytes of move followed by 8 bytes of key, least significant first.
+static const int RADIX_PASSES = 10;
+
+static inline uint8_t radix_digit(const struct BookEntry &be, int pass) {
+  if (pass < 2) {
+    return be.move >> (8 * pass);
+  }
+  return be.key >> (8 * (pass - 2));
+}
+
+// Run `fn(i)` for i in [0, n) on n threads, the first on this one.
+template <typename F> static void run_threads(int n, F fn) {
+  vector<thread> workers;
+  for (int i = 1; i < n; i++) {
+    workers.emplace_back(fn, i);
+  }
+  fn(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Sorts [entries, entries + n) by (key, move), using tmp as scratch space.
+static void radix_sort(struct BookEntry *entries, struct BookEntry *tmp,
+                       size_t n) {
+  if (n < MIN_RADIX_SORT) {
+    sort(entries, entries + n);
+    return;
+  }
+
+  // Histograms for every pass in one go.
+  static thread_local size_t counts[RADIX_PASSES][256];
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < n; i++) {
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+      counts[pass][radix_digit(entries[i], pass)]++;
+    }
+  }
+
+  struct BookEntry *src = entries;
+  struct BookEntry *dst = tmp;
+  for (int pass = 0; pass < RADIX_PASSES; pass++) {
+    size_t *count = counts[pass];
+    // Every entry has the same digit, e.g. the high key bits we partitioned
+    // on, so this pass wouldn't move anything.
+    if (count[radix_digit(src[0], pass)] == n) {
+      continue;
+    }
+
+    size_t offset = 0;
+    for (int d = 0; d < 256; d++) {
+      size_t c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[count[radix_digit(src[i], pass)]++] = src[i];
+    }
+    swap(src, dst);
+  }
+
+  if (src != entries) {
+    memcpy(entries, src, n * sizeof(struct BookEntry));
+  }
+}
+
+// Reduces the sorted [entries, entries + n) in place, returning the new size.
+static size_t reduce_range(struct BookEntry *entries, size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+
+  size_t last = 0;
+  for (size_t i = 1; i < n; i++) {
+    if (entries[last].key == entries[i].key &&
+        entries[last].move == entries[i].move) {
+      combine_entries(entries[last], entries[i]);
+    } else {
+      entries[++last] = entries[i];
+    }
+  }
+  return last + 1;
+}
+
+void sort_and_reduce(vector<struct BookEntry> &entries, int threads) {
+  size_t n = entries.size();
+  threads = max(threads, 1);
+  if (n < MIN_RADIX_SORT) {
+    sort(entries.begin(), entries.end());
+    entries.resize(reduce_range(entries.data(), n));
+    return;
+  }
+
+  // Cache sized buckets, and at least a few per thread so that uneven
+  // buckets still balance out.
+  int bits = 0;
+  while (bits < MAX_BUCKET_BITS && (((size_t)1 << bits) < (size_t)threads * 4 ||
+                                    (n >> bits) > BUCKET_ENTRIES)) {
+    bits++;
+  }
+  const size_t num_buckets = (size_t)1 << bits;
+  auto bucket_of = [bits](const struct BookEntry &be) -> size_t {
+    return bits == 0 ? 0 : be.key >> (64 - bits);
+  };
+
+  // Partition into `partitioned`, each thread scattering its own slice of
+  // the input.
+  vector<struct BookEntry> partitioned(n);
+  vector<vector<size_t>> offsets(threads, vector<size_t>(num_buckets, 0));
+  auto slice = [&](int t) {
+    return make_pair(n * t / threads, n * (t + 1) / threads);
+  };
+  run_threads(threads, [&](int t) {
+    auto [begin, end] = slice(t);
+    for (size_t i = begin; i < end; i++) {
+      offsets[t][bucket_of(entries[i])]++;
+    }
+  });
+
+  vector<size_t> bucket_start(num_buckets + 1, 0);
+  {
+    size_t offset = 0;
+    for (size_t b = 0; b < num_buckets; b++) {
+      bucket_start[b] = offset;
+      for (int t = 0; t < threads; t++) {
+        size_t c = offsets[t][b];
+        offsets[t][b] = offset;
+        offset += c;
+      }
+    }
+    bucket_start[num_buckets] = offset;
+  }
+
+  run_threads(threads, [&](int t) {
+    auto [begin, end] = slice(t);
+    auto &offset = offsets[t];
+    for (size_t i = begin; i < end; i++) {
+      partitioned[offset[bucket_of(entries[i])]++] = entries[i];
+    }
+  });
+
+  // Sort and reduce each bucket. `entries` is free now, so it serves as the
+  // scratch space.
+  vector<size_t> reduced_size(num_buckets);
+  atomic<size_t> next_bucket = 0;
+  run_threads(threads, [&](int) {
+    size_t b;
+    while ((b = next_bucket++) < num_buckets) {
+      size_t begin = bucket_start[b];
+      size_t size = bucket_start[b + 1] - begin;
+      radix_sort(partitioned.data() + begin, entries.data() + begin, size);
+      reduced_size[b] = reduce_range(partitioned.data() + begin, size);
+    }
+  });
+
+  // Buckets are in key order, so concatenating them is all that's left.
+  size_t out = 0;
+  for (size_t b = 0; b < num_buckets; b++) {
+    memcpy(entries.data() + out, partitioned.data() + bucket_start[b],
+           reduced_size[b] * sizeof(struct BookEntry));
+    out += reduced_size[b];
+  }
+  entries.resize(out);
+}
@@ -0,0 +1,18 @@
+#ifndef _ENTRY_SORT_H_
+#define _ENTRY_SORT_H_
+
+#include "polyglot.h"
+
+/*
+ * Sort `entries` and reduce them to normal form, in place. Same result as
+ * `sort` followed by `reduce_to_normal_form`, but much faster:
+ * - Entries are partitioned by the high bits of their key into cache sized
+ *   buckets, using `threads` threads. Since buckets are ordered by key, the
+ *   sorted buckets only need to be concatenated, not merged.
+ * - Each bucket is LSD radix sorted on (key, move) and then reduced, with
+ *   the buckets spread over the threads.
+ * Needs a scratch buffer as large as `entries`.
+ */
+void sort_and_reduce(vector<struct BookEntry> &entries, int threads);
+
+#endif /* _ENTRY_SORT_H_ */
@@ -0,0 +1,79 @@
+#include "entry_table.h"
+#include <algorithm>
+
+// Start small, the table doubles as needed.
+static const int INITIAL_BITS = 16;
+
+EntryTable::EntryTable() {}
+
+size_t EntryTable::index(uint64_t key, uint16_t move) const {
+  // Keys are Zobrist hashes and already well mixed, but the same key shows
+  // up with several moves, which should land in different slots.
+  uint64_t h = (key ^ (move * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+  return h >> (64 - bits);
+}
+
+void EntryTable::add(uint64_t key, uint16_t move, uint16_t weight) {
+  // Keep the load factor below 3/4 so that probes stay short.
+  if ((used + 1) * 4 > slots.size() * 3) {
+    grow();
+  }
+
+  size_t mask = slots.size() - 1;
+  for (size_t i = index(key, move);; i = (i + 1) & mask) {
+    struct Slot &slot = slots[i];
+    if (slot.weight == 0) {
+      slot.key = key;
+      slot.move = move;
+      slot.weight = weight;
+      used++;
+      return;
+    }
+    if (slot.key == key && slot.move == move) {
+      // Saturate like combine_entries, the sum is drained into 16 bits.
+      slot.weight = min<uint32_t>(slot.weight + weight, UINT16_MAX);
+      return;
+    }
+  }
+}
+
+void EntryTable::grow() {
+  vector<struct Slot> old_slots;
+  old_slots.swap(slots);
+
+  bits = old_slots.empty() ? INITIAL_BITS : bits + 1;
+  slots.assign((size_t)1 << bits, {0, 0, 0, 0});
+
+  size_t mask = slots.size() - 1;
+  for (auto &old_slot : old_slots) {
+    if (old_slot.weight == 0) {
+      continue;
+    }
+    size_t i = index(old_slot.key, old_slot.move);
+    while (slots[i].weight != 0) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = old_slot;
+  }
+}
+
+size_t EntryTable::size() const { return used; }
+
+size_t EntryTable::memory() const { return slots.size() * sizeof(struct Slot); }
+
+void EntryTable::drain(vector<struct BookEntry> &entries) {
+  entries.reserve(entries.size() + used);
+  for (auto &slot : slots) {
+    if (slot.weight == 0) {
+      continue;
+    }
+    entries.push_back({.key = slot.key,
+                       .move = slot.move,
+                       .weight = (uint16_t)slot.weight,
+                       .learn = 0});
+  }
+
+  slots = vector<struct Slot>();
+  used = 0;
+  bits = 0;
+}
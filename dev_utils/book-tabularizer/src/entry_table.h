@@ -0,0 +1,51 @@
+#ifndef _ENTRY_TABLE_H_
+#define _ENTRY_TABLE_H_
+
+#include "polyglot.h"
+
+using namespace std;
+
+/*
+ * Aggregates weights by (key, move) as entries come in, so that memory grows
+ * with the number of distinct moves rather than the number of plies. An open
+ * addressing table with linear probing, with slots the size of a BookEntry
+ * but a 32-bit weight.
+ */
+class EntryTable {
+public:
+  EntryTable();
+
+  void add(uint64_t key, uint16_t move, uint16_t weight);
+
+  // Number of distinct (key, move) pairs.
+  size_t size() const;
+
+  // Bytes taken up by the slots.
+  size_t memory() const;
+
+  /*
+   * Append the aggregated entries to `entries`, in no particular order, and
+   * empty the table, freeing its memory.
+   */
+  void drain(vector<struct BookEntry> &entries);
+
+private:
+  struct Slot {
+    uint64_t key;
+    uint16_t move;
+    uint16_t padding;
+    // 0 marks an empty slot, since every entry has a weight of at least 1.
+    uint32_t weight;
+  };
+  static_assert(sizeof(struct Slot) == 16);
+
+  size_t index(uint64_t key, uint16_t move) const;
+
+  void grow();
+
+  vector<struct Slot> slots;
+  size_t used = 0;
+  int bits = 0;
+};
+
+#endif /* _ENTRY_TABLE_H_ */
@@ -0,0 +1,28 @@
+#include "game_set.h"
+
+GameSet::GameSet(size_t filter_bytes)
+    : bits((filter_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t)) {}
+
+bool GameSet::insert(uint64_t hash) {
+  // The hashes come from FNV, whose high bits aren't spread well enough on
+  // their own.
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+
+  if (bits.empty()) {
+    auto &shard = shards[hash % NUM_SHARDS];
+    lock_guard<mutex> guard(shard.lock);
+    return shard.hashes.insert(hash).second;
+  }
+
+  // All probes go to the same word, so that setting them is one atomic
+  // step. Otherwise two threads inserting the same game at once could both
+  // find some of its bits new.
+  auto &word = bits[(hash >> 32) % bits.size()];
+  uint64_t mask = 0;
+  for (int i = 0; i < NUM_PROBES; i++) {
+    mask |= 1ULL << ((hash >> (6 * i)) & 63);
+  }
+  return (word.fetch_or(mask, memory_order_relaxed) & mask) != mask;
+}
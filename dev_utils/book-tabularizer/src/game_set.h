@@ -0,0 +1,49 @@
+#ifndef _GAME_SET_H_
+#define _GAME_SET_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// What makes two games duplicates of each other.
+enum class Dedup {
+  Off,
+  // The same moves and result.
+  Games,
+  // The same result and moves up to the ply limit, i.e. the same entries.
+  Openings,
+};
+
+/*
+ * The games seen so far, by hash, shared by all builders. Either an exact
+ * set, or a Bloom filter of fixed size, which now and then takes a new game
+ * for one it has seen.
+ */
+class GameSet {
+public:
+  // A Bloom filter of `filter_bytes`, or an exact set if it's 0.
+  GameSet(size_t filter_bytes);
+
+  // Add `hash`, returning whether it's new. Safe to call from any thread.
+  bool insert(uint64_t hash);
+
+private:
+  static const int NUM_SHARDS = 64;
+  static const int NUM_PROBES = 4;
+
+  // The exact set is split by hash, so that threads rarely wait on each
+  // other.
+  struct Shard {
+    mutex lock;
+    unordered_set<uint64_t> hashes;
+  };
+  Shard shards[NUM_SHARDS];
+
+  vector<atomic<uint64_t>> bits;
+};
+
+#endif /* _GAME_SET_H_ */
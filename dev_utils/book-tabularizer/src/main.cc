@@ -1,292 +1,1270 @@
 #include "argparse.h"
 #include "chess.h"
+#include "codegen.h"
+#include "entry_merge.h"
+#include "entry_sort.h"
+#include "game_set.h"
+#include "manifest.h"
+#include "mapped_file.h"
+#include "metrics.h"
 #include "pg_builder.h"
+#include "pgn_gen.h"
+#include "pgn_split.h"
+#include "piped_input.h"
 #include "polyglot.h"
+#include "spill.h"
+#include "staged_parse.h"
+#include "thread_pool.h"
 #include "tinylogger.h"
+#include "util.h"
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <sys/mman.h>
+#include <thread>
+#include <tuple>
 
-int build(string pgn, string bin, int max_plies, int elo_cutoff,
-          int max_elo_diff) {
-  ifstream pgn_strm(pgn);
-  ofstream bin_strm(bin, ios::binary);
+// What this run counted and timed, reported at the end.
+static Metrics metrics;
 
-  if (!pgn_strm.is_open()) {
-    LOG_ERROR("could not open file %s\n", pgn.c_str());
-    return EXIT_FAILURE;
+struct BuildOptions {
+  int max_plies;
+  int elo_cutoff;
+  int max_elo_diff;
+  bool use_mmap;
+  int threads;
+  // In bytes, 0 for no limit.
+  size_t memory_budget;
+  string tmp_dir;
+  bool aggregate;
+  bool memoize;
+  Dedup dedup;
+  // In bytes, 0 to track games exactly.
+  size_t dedup_filter_bytes;
+  // Tokenize and replay in separate stages, see parse_staged.
+  bool staged;
+  // Batches each queue between the stages holds.
+  size_t queue_depth;
+};
+
+// Set up the builders as `opts` asks, sharing `spiller` and `seen_games` (if
+// any) and the memory budget between them.
+static void configure_builders(vector<PGBuilder> &pg_builders,
+                               const struct BuildOptions &opts,
+                               RunSpiller *spiller, GameSet *seen_games) {
+  for (auto &pg_builder : pg_builders) {
+    pg_builder.elo_cutoff = opts.elo_cutoff;
+    pg_builder.max_elo_diff = opts.max_elo_diff;
+    pg_builder.max_plies = opts.max_plies;
+    pg_builder.aggregate = opts.aggregate;
+    pg_builder.memoize = opts.memoize;
+    pg_builder.metrics = &metrics;
+    if (seen_games) {
+      pg_builder.dedup = opts.dedup;
+      pg_builder.seen_games = seen_games;
+    }
+    if (spiller) {
+      pg_builder.spiller = spiller;
+      pg_builder.spill_entries = max(
+          opts.memory_budget / sizeof(struct BookEntry) / pg_builders.size(),
+          (size_t)1);
+      // Don't let the vector's growth overshoot the budget.
+      if (!opts.aggregate) {
+        pg_builder.entries.reserve(pg_builder.spill_entries);
+      }
+    }
   }
-  if (!bin_strm.is_open()) {
-    LOG_ERROR("could not open file %s\n", bin.c_str());
-    return EXIT_FAILURE;
+}
+
+/*
+ * Set up builders configured for a plain parse to run in stages, where the
+ * first one aggregates the entries the others replay. The others hand their
+ * entries on after every batch, so the whole memory budget goes to the
+ * first.
+ */
+static void configure_stages(vector<PGBuilder> &pg_builders,
+                             const struct BuildOptions &opts) {
+  for (size_t i = 1; i < pg_builders.size(); i++) {
+    pg_builders[i].aggregate = false;
+    pg_builders[i].spiller = nullptr;
+    pg_builders[i].entries = vector<struct BookEntry>();
+  }
+  auto &sink = pg_builders[0];
+  if (sink.spiller) {
+    sink.spill_entries =
+        max(opts.memory_budget / sizeof(struct BookEntry), (size_t)1);
+    if (!opts.aggregate) {
+      sink.entries.reserve(sink.spill_entries);
+    }
   }
+}
 
-  PGBuilder pg_builder;
-  pg_builder.elo_cutoff = elo_cutoff;
-  pg_builder.max_elo_diff = max_elo_diff;
-  pg_builder.max_plies = max_plies;
+/*
+ * Reduce everything the builders collected into one book, calling `emit` for
+ * each of its entries in order. The builders are left empty.
+ */
+static bool reduce_book(vector<PGBuilder> &pg_builders, RunSpiller *spiller,
+                        const struct BuildOptions &opts,
+                        const function<void(const struct BookEntry &)> &emit) {
+  for (auto &pg_builder : pg_builders) {
+    pg_builder.flush_counters();
+  }
+  if (opts.memoize) {
+    size_t hits = 0, lookups = 0;
+    for (auto &pg_builder : pg_builders) {
+      hits += pg_builder.replay_cache.hits;
+      lookups += pg_builder.replay_cache.lookups;
+    }
+    LOG_DEBUG("replay cache hit %d of %d lookups\n", hits, lookups);
+  }
+  if (opts.dedup != Dedup::Off) {
+    LOG_DEBUG("dropped %d duplicate games, kept %d\n",
+              (size_t)metrics.duplicate_games, (size_t)metrics.unique_games);
+  }
 
-  pgn::StreamParser parser(pgn_strm);
-  auto error = parser.readGames(pg_builder);
+  // From here on, aggregated entries are handled like any others. They're
+  // already reduced, but reducing them again doesn't change them.
+  if (opts.aggregate) {
+    StageTimer timer(metrics, "sort");
+    size_t distinct = 0;
+    for (auto &pg_builder : pg_builders) {
+      distinct += pg_builder.table.size();
+      pg_builder.table.drain(pg_builder.entries);
+    }
+    LOG_DEBUG("aggregated into %d distinct entries\n", distinct);
+  }
 
-  if (error) {
-    LOG_ERROR("could not parse pgn\n", error.message().c_str());
-    return EXIT_FAILURE;
+  if (spiller) {
+    if (spiller->failed()) {
+      return false;
+    }
+
+    LOG_DEBUG("spilled %d runs\n", spiller->num_runs());
+
+    // Whatever the builders still hold is merged straight from memory.
+    vector<vector<struct BookEntry>> tails;
+    for (auto &pg_builder : pg_builders) {
+      tails.push_back(std::move(pg_builder.entries));
+    }
+
+    // Writing can't be told apart from merging here.
+    StageTimer timer(metrics, "merge");
+    size_t num_written = 0;
+    bool ok = spiller->merge(tails, [&](const struct BookEntry &be) {
+      emit(be);
+      num_written++;
+    });
+    if (!ok) {
+      return false;
+    }
+    metrics.book_entries += num_written;
+    LOG_DEBUG("wrote %d entries\n", num_written);
+    LOG_DEBUG("peak RSS %.1f MB\n", peak_rss() / 1e6);
+
+    return true;
+  }
+
+  // Concatenate in input order, so that we sort exactly what a single thread
+  // would have produced and the output doesn't depend on the thread count.
+  auto &pg_builder = pg_builders[0];
+  {
+    size_t total_entries = 0;
+    for (auto &other : pg_builders) {
+      total_entries += other.entries.size();
+    }
+    pg_builder.entries.reserve(total_entries);
+    for (size_t i = 1; i < pg_builders.size(); i++) {
+      auto &other = pg_builders[i];
+      pg_builder.entries.insert(pg_builder.entries.end(),
+                                other.entries.begin(), other.entries.end());
+      other.entries = vector<struct BookEntry>();
+    }
   }
 
   // Sort the entries. This is formally part of the polyglot spec.
-  sort(pg_builder.entries.begin(), pg_builder.entries.end());
   // Not sure if reducing is part of the spec, but why not. It saves some
   // space.
-  auto reduced_entries = reduce_to_normal_form(pg_builder.entries);
-  pg_builder.entries.clear();
+  StageTimer sort_timer(metrics, "sort");
+  sort_and_reduce(pg_builder.entries, opts.threads);
+  LOG_DEBUG("sorted and reduced in %.2fs\n", sort_timer.stop());
 
-  LOG_DEBUG("writing %d entries\n", reduced_entries.size());
+  LOG_DEBUG("writing %d entries\n", pg_builder.entries.size());
+  metrics.book_entries += pg_builder.entries.size();
 
-  // Finally, write it to stream
-  write_pg_file(bin_strm, reduced_entries);
+  // Finally, hand it on
+  StageTimer write_timer(metrics, "write");
+  for (auto &be : pg_builder.entries) {
+    emit(be);
+  }
+  write_timer.stop();
+  pg_builder.entries = vector<struct BookEntry>();
+  LOG_DEBUG("peak RSS %.1f MB\n", peak_rss() / 1e6);
 
-  bin_strm.close();
-  pgn_strm.close();
+  return true;
+}
 
-  return EXIT_SUCCESS;
+int build(string pgn, string bin, struct BuildOptions opts) {
+  bool use_mmap = opts.use_mmap;
+  int threads = opts.threads;
+  // Compressed PGNs and stdin can only be streamed. They're read and
+  // decompressed on a separate thread while we parse.
+  bool piped = pgn == "-" || detect_compression(pgn) != Compression::None;
+  if (piped) {
+    use_mmap = false;
+  }
+
+  // A PGN that can't be split is tokenized on one thread and replayed on
+  // the others instead.
+  bool staged = opts.staged || (threads > 1 && !use_mmap);
+
+  // Either map the PGN and let the parser read it in place, or go through a
+  // stream, which copies everything into the parser's buffer first.
+  MappedFile pgn_file;
+  PipedInput pgn_pipe;
+  ifstream pgn_strm;
+  if (use_mmap) {
+    if (!pgn_file.open(pgn, MADV_SEQUENTIAL)) {
+      return EXIT_FAILURE;
+    }
+  } else if (piped) {
+    if (!pgn_pipe.open(pgn)) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    pgn_strm.open(pgn);
+    if (!pgn_strm.is_open()) {
+      LOG_ERROR("could not open file %s\n", pgn.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  PGWriter bin_writer;
+  if (!bin_writer.open(bin)) {
+    return EXIT_FAILURE;
+  }
+
+  // A mapped PGN is split at game boundaries into one range per thread, and
+  // each range gets its own builder.
+  vector<string_view> ranges;
+  if (use_mmap) {
+    ranges = split_pgn(pgn_file.view(), staged ? 1 : threads);
+  } else {
+    ranges.resize(1);
+  }
+
+  // With a memory budget, each builder gets an equal share of it and spills
+  // its entries into runs whenever it's used up.
+  unique_ptr<RunSpiller> spiller;
+  if (opts.memory_budget > 0) {
+    spiller = make_unique<RunSpiller>(opts.memory_budget, opts.tmp_dir);
+  }
+
+  unique_ptr<GameSet> seen_games;
+  if (opts.dedup != Dedup::Off) {
+    seen_games = make_unique<GameSet>(opts.dedup_filter_bytes);
+  }
+
+  // Staged, the first builder only aggregates what the others replayed.
+  vector<PGBuilder> pg_builders(staged ? threads + 1 : ranges.size());
+  configure_builders(pg_builders, opts, spiller.get(), seen_games.get());
+  if (staged) {
+    configure_stages(pg_builders, opts);
+  }
+
+  auto read_games = [&](auto &parser, size_t i) {
+    if (!staged) {
+      return parser.readGames(pg_builders[i]);
+    }
+    LOG_DEBUG("parsing in stages, replaying on %d threads\n", threads);
+    return parse_staged(
+        [&](pgn::Visitor &visitor) { return parser.readGames(visitor); },
+        pg_builders, opts.queue_depth);
+  };
+
+  StageTimer parse_timer(metrics, "parse");
+  vector<pgn::StreamParserError> errors(ranges.size());
+  size_t bytes_parsed;
+  if (use_mmap) {
+    LOG_DEBUG("parsing %d ranges\n", ranges.size());
+    auto parse_range = [&](size_t i) {
+      pgn::StreamParser parser(ranges[i]);
+      errors[i] = read_games(parser, i);
+    };
+
+    // The first range is parsed on this thread.
+    vector<thread> workers;
+    for (size_t i = 1; i < ranges.size(); i++) {
+      workers.emplace_back(parse_range, i);
+    }
+    parse_range(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    bytes_parsed = pgn_file.size();
+  } else if (piped) {
+    istream pipe_strm(&pgn_pipe);
+    pgn::StreamParser parser(pipe_strm);
+    errors[0] = read_games(parser, 0);
+    if (pgn_pipe.failed()) {
+      LOG_ERROR("could not read %s\n", pgn.c_str());
+      return EXIT_FAILURE;
+    }
+    bytes_parsed = pgn_pipe.bytes_out();
+    LOG_DEBUG("read %.1f MB of input for %.1f MB of PGN\n",
+              pgn_pipe.bytes_in() / 1e6, bytes_parsed / 1e6);
+  } else {
+    pgn::StreamParser parser(pgn_strm);
+    errors[0] = read_games(parser, 0);
+    bytes_parsed = filesystem::file_size(pgn);
+  }
+
+  for (auto &error : errors) {
+    if (error) {
+      LOG_ERROR("could not parse pgn\n", error.message().c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  double parse_time = parse_timer.stop();
+  metrics.bytes_parsed += bytes_parsed;
+  LOG_DEBUG("parsed %.1f MB in %.2fs (%.1f MB/s)\n", bytes_parsed / 1e6,
+            parse_time, bytes_parsed / 1e6 / parse_time);
+
+  bool ok = reduce_book(
+      pg_builders, spiller.get(), opts,
+      [&](const struct BookEntry &be) { bin_writer.write(be); });
+  ok = bin_writer.close() && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int codegen(string bin, string out, uint64_t min_position_frequency,
-            uint16_t min_move_frequency, uint16_t top_k) {
-  ifstream bin_strm(bin, ios::binary);
-  ofstream out_strm(out);
+// Every PGN in `books_dir`, compressed or not.
+static bool list_books(const string &books_dir, vector<string> &paths) {
+  error_code ec;
+  for (auto &dirent : filesystem::directory_iterator(books_dir, ec)) {
+    string path = dirent.path().string();
+    bool is_pgn = path.ends_with(".pgn") || path.ends_with(".pgn.gz") ||
+                  path.ends_with(".pgn.zst");
+    if (dirent.is_regular_file() && is_pgn) {
+      paths.push_back(path);
+    }
+  }
+  if (ec) {
+    LOG_ERROR("could not read directory %s: %s\n", books_dir.c_str(),
+              ec.message().c_str());
+    return false;
+  }
+  if (paths.empty()) {
+    LOG_ERROR("no PGNs in %s\n", books_dir.c_str());
+    return false;
+  }
+  return true;
+}
+
+// A book to parse, mapped once a worker gets to it.
+struct BookFile {
+  string path;
+  bool piped;
+  // Where to start parsing. Only plain PGNs start past 0.
+  size_t offset;
+  MappedFile pgn_file;
+};
+
+// Books at least twice this size are split, so idle workers can take parts.
+static const size_t MIN_SPLIT_BYTES = 64 << 20;
+
+/*
+ * Parse the PGNs in `paths` on a work-stealing pool of `opts.threads`
+ * workers, each with its own builder in `pg_builders`. Books are handed out
+ * largest first, and large ones are split into ranges for idle workers to
+ * take.
+ *
+ * `offsets`, if not empty, holds where to start in each of the PGNs, so that
+ * only what was appended to them is parsed.
+ */
+static bool parse_books(const vector<string> &paths,
+                        const vector<size_t> &offsets,
+                        const struct BuildOptions &opts, RunSpiller *spiller,
+                        vector<PGBuilder> &pg_builders) {
+  // Compressed PGNs are ranked by a rough guess of their PGN size.
+  vector<tuple<size_t, string, size_t>> ranked;
+  for (size_t i = 0; i < paths.size(); i++) {
+    auto &path = paths[i];
+    size_t offset = offsets.empty() ? 0 : offsets[i];
+    error_code ec;
+    size_t size = filesystem::file_size(path, ec);
+    if (ec) {
+      LOG_ERROR("could not open file %s\n", path.c_str());
+      return false;
+    }
+    if (size <= offset) {
+      continue;
+    }
+    size -= offset;
+    if (detect_compression(path) != Compression::None) {
+      size *= 4;
+    }
+    ranked.emplace_back(size, path, offset);
+  }
+  sort(ranked.rbegin(), ranked.rend());
+
+  vector<struct BookFile> books(ranked.size());
+  for (size_t i = 0; i < ranked.size(); i++) {
+    books[i].path = get<1>(ranked[i]);
+    books[i].piped = detect_compression(books[i].path) != Compression::None;
+    books[i].offset = get<2>(ranked[i]);
+  }
+
+  // One builder per worker, which collects the entries of every book and
+  // range the worker parses. The book is the same no matter who parsed what.
+  // Duplicates are looked for across all books.
+  unique_ptr<GameSet> seen_games;
+  if (opts.dedup != Dedup::Off) {
+    seen_games = make_unique<GameSet>(opts.dedup_filter_bytes);
+  }
+
+  ThreadPool pool(opts.threads);
+  pg_builders = vector<PGBuilder>(pool.size());
+  configure_builders(pg_builders, opts, spiller, seen_games.get());
+
+  atomic<bool> failed = false;
+  atomic<size_t> bytes_parsed = 0;
+  auto parse = [&](int worker, const string &path, auto &parser) {
+    if (parser.readGames(pg_builders[worker])) {
+      LOG_ERROR("could not parse %s\n", path.c_str());
+      failed = true;
+    }
+  };
+
+  StageTimer parse_timer(metrics, "parse");
+  for (size_t b = 0; b < books.size(); b++) {
+    pool.submit([&, b](int worker) {
+      auto &book = books[b];
+      LOG_DEBUG("building %s\n", book.path.c_str());
+      if (book.piped) {
+        PipedInput pgn_pipe;
+        if (!pgn_pipe.open(book.path)) {
+          failed = true;
+          return;
+        }
+        istream pipe_strm(&pgn_pipe);
+        pgn::StreamParser parser(pipe_strm);
+        parse(worker, book.path, parser);
+        if (pgn_pipe.failed()) {
+          LOG_ERROR("could not read %s\n", book.path.c_str());
+          failed = true;
+        }
+        bytes_parsed += pgn_pipe.bytes_out();
+        metrics.bytes_parsed += pgn_pipe.bytes_out();
+        return;
+      }
 
-  if (!bin_strm.is_open()) {
-    LOG_ERROR("could not open file %s\n", bin.c_str());
+      if (!book.pgn_file.open(book.path, MADV_SEQUENTIAL)) {
+        failed = true;
+        return;
+      }
+      string_view pgn = book.pgn_file.view().substr(book.offset);
+      size_t parts = clamp(pgn.size() / MIN_SPLIT_BYTES, (size_t)1,
+                           (size_t)pool.size());
+      auto ranges = split_pgn(pgn, parts);
+      // Parse the first range now and leave the others up for grabs.
+      for (size_t i = 1; i < ranges.size(); i++) {
+        pool.spawn(worker, [&, b, range = ranges[i]](int thread) {
+          pgn::StreamParser parser(range);
+          parse(thread, books[b].path, parser);
+        });
+      }
+      pgn::StreamParser parser(ranges[0]);
+      parse(worker, book.path, parser);
+      bytes_parsed += pgn.size();
+      metrics.bytes_parsed += pgn.size();
+    });
+  }
+  pool.run();
+
+  if (failed || (spiller && spiller->failed())) {
+    return false;
+  }
+
+  double parse_time = parse_timer.stop();
+  LOG_DEBUG("parsed %d books, %.1f MB in %.2fs (%.1f MB/s)\n", books.size(),
+            bytes_parsed / 1e6, parse_time, bytes_parsed / 1e6 / parse_time);
+  return true;
+}
+
+int build_all(string books_dir, string bin, struct BuildOptions opts) {
+  vector<string> paths;
+  if (!list_books(books_dir, paths)) {
     return EXIT_FAILURE;
   }
-  if (!out_strm.is_open()) {
-    LOG_ERROR("could not open file %s\n", out.c_str());
+
+  PGWriter bin_writer;
+  if (!bin_writer.open(bin)) {
     return EXIT_FAILURE;
   }
 
-  auto entries = read_pg_file(bin_strm);
-  if (entries.size() == 0) {
-    LOG_ERROR("polyglot file has no entries\n");
+  unique_ptr<RunSpiller> spiller;
+  if (opts.memory_budget > 0) {
+    spiller = make_unique<RunSpiller>(opts.memory_budget, opts.tmp_dir);
+  }
+
+  vector<PGBuilder> pg_builders;
+  if (!parse_books(paths, {}, opts, spiller.get(), pg_builders)) {
     return EXIT_FAILURE;
   }
 
-  sort(entries.begin(), entries.end());
-  auto reduced_entries = reduce_to_normal_form(entries);
-  entries.clear();
+  bool ok = reduce_book(
+      pg_builders, spiller.get(), opts,
+      [&](const struct BookEntry &be) { bin_writer.write(be); });
+  ok = bin_writer.close() && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-  LOG_DEBUG("got %d reduced entries, filtering them down\n",
-            reduced_entries.size());
+// Entries of each book read at a time while merging books.
+static const size_t MERGE_BUFFER_ENTRIES = 1 << 12;
 
-  // We're going to create groups of entries:
-  // Each group correspond to a single position. Entries in the group are
-  // weighted moves for the position.
-  // Then, we'll figure out which positions to keep by doing a frequency
-  // cutoff. The frequency of the position is determined by the total weight
-  // of the group.
+// Whether `book` is sorted and reduced, as every book we write is.
+static bool is_sorted_book(const PolyglotFile &book) {
+  PolyglotCursor cursor(book, MERGE_BUFFER_ENTRIES);
+  if (cursor.done()) {
+    return true;
+  }
+  struct BookEntry prev = cursor.peek();
+  for (cursor.advance(); !cursor.done(); cursor.advance()) {
+    if (!(prev < cursor.peek())) {
+      return false;
+    }
+    prev = cursor.peek();
+  }
+  return true;
+}
 
-  // The first step is to group the entries.
-  vector<vector<struct BookEntry *>> groups;
-  {
-    auto &group_key = reduced_entries[0].key;
-    vector<struct BookEntry *> curr_group;
-    for (auto &be : reduced_entries) {
-      if (be.key != group_key) {
-        // New group. Copy the group and push it.
-        groups.push_back(curr_group);
-
-        group_key = be.key;
-        curr_group.clear();
-      }
+// The options that change what goes into a book. A book built with other
+// ones can't be added to.
+static string book_options(const struct BuildOptions &opts) {
+  return "max-plies=" + to_string(opts.max_plies) +
+         " elo-cutoff=" + to_string(opts.elo_cutoff) +
+         " max-elo-diff=" + to_string(opts.max_elo_diff) +
+         " dedup=" + to_string((int)opts.dedup);
+}
+
+// Whether what follows `offset` in the PGN at `path` starts with a game, so
+// that it can be parsed on its own.
+static bool starts_game(const string &path, size_t offset) {
+  MappedFile pgn_file;
+  if (!pgn_file.open(path, MADV_SEQUENTIAL)) {
+    return false;
+  }
+  string_view tail = pgn_file.view().substr(offset);
+  size_t start = tail.find_first_not_of(" \t\r\n");
+  return start != string_view::npos && tail[start] == '[';
+}
+
+/*
+ * Bring the book at `bin` up to date with the PGNs in `paths`. A manifest
+ * next to the book records what went into it, so only new PGNs and what was
+ * appended to plain ones are parsed. Their entries are merged into the book,
+ * which is read back whole. Any other change to the inputs, or to the
+ * options, means a full rebuild.
+ */
+int build_incremental(vector<string> paths, string bin,
+                      struct BuildOptions opts) {
+  string manifest_path = bin + ".manifest";
+  struct Manifest manifest;
+  manifest.options = book_options(opts);
 
-      curr_group.push_back(&be);
+  struct Manifest old_manifest;
+  bool full = false;
+  if (!read_manifest(manifest_path, old_manifest)) {
+    LOG_INFO("no manifest for %s, building it from scratch\n", bin.c_str());
+    full = true;
+  } else {
+    uint64_t size, hash, prefix_hash;
+    if (!hash_file(bin, 0, size, hash, prefix_hash) ||
+        size != old_manifest.book_size || hash != old_manifest.book_hash) {
+      LOG_INFO("%s doesn't match its manifest, rebuilding it\n", bin.c_str());
+      full = true;
+    } else if (old_manifest.options != manifest.options) {
+      LOG_INFO("%s was built with other options, rebuilding it\n",
+               bin.c_str());
+      full = true;
     }
-    // Don't forget the last group.
-    groups.push_back(curr_group);
   }
 
-  LOG_DEBUG("got %d groups\n", groups.size());
+  map<string, struct ManifestInput> known;
+  for (auto &input : old_manifest.inputs) {
+    known[input.path] = input;
+  }
 
-  // We find the frequencies for each group/position by iterating over the
-  // groups and summing up the weight of its entries.
-  // We could've done all of this in one pass earlier, but it would be a lot
-  // harder to read for being only slightly more efficient.
-  vector<uint64_t> position_frequencies;
-  vector<uint16_t> max_weights;
-  {
-    // No need for resizing later.
-    position_frequencies.resize(groups.size());
-    max_weights.resize(groups.size());
-
-    for (int i = 0; i < groups.size(); i++) {
-      auto &group = groups[i];
-      uint64_t position_frequency = 0;
-      max_weights[i] = 0;
-      for (auto be : group) {
-        position_frequency += be->weight;
-        max_weights[i] = max(max_weights[i], be->weight);
-      }
-      position_frequencies[i] = position_frequency;
+  // What to parse, and where to start in it.
+  vector<string> added;
+  vector<size_t> offsets;
+  StageTimer hash_timer(metrics, "hash");
+  for (auto &path : paths) {
+    auto it = known.find(path);
+    bool is_known = !full && it != known.end();
+    uint64_t prefix = is_known ? it->second.size : 0;
+
+    struct ManifestInput input = {.path = path, .size = 0, .hash = 0};
+    uint64_t prefix_hash = 0;
+    if (!hash_file(path, prefix, input.size, input.hash, prefix_hash)) {
+      return EXIT_FAILURE;
+    }
+    manifest.inputs.push_back(input);
+    if (full) {
+      continue;
+    }
+    if (!is_known) {
+      added.push_back(path);
+      offsets.push_back(0);
+      continue;
     }
+
+    auto old_input = it->second;
+    known.erase(it);
+    if (input.size == old_input.size && input.hash == old_input.hash) {
+      continue;
+    }
+    bool appended = input.size > old_input.size &&
+                    prefix_hash == old_input.hash &&
+                    detect_compression(path) == Compression::None &&
+                    starts_game(path, old_input.size);
+    if (!appended) {
+      LOG_INFO("%s changed, rebuilding %s\n", path.c_str(), bin.c_str());
+      full = true;
+      continue;
+    }
+    added.push_back(path);
+    offsets.push_back(old_input.size);
+  }
+  hash_timer.stop();
+  if (!full && !known.empty()) {
+    LOG_INFO("%s is gone, rebuilding %s\n", known.begin()->first.c_str(),
+             bin.c_str());
+    full = true;
   }
 
-  // We begin writing to the file:
-  // - Iterate through each group
-  // - Sort the moves in the group. Keep the top K moves that are above the
-  //   frequency filter.
-  // - Write the group
-  {
-    uint32_t groups_kept = 0;
-    uint32_t moves_kept = 0;
-    out_strm << "pub const table = [";
-    for (int i = 0; i < groups.size(); i++) {
-      auto &group = groups[i];
-      // Skip this position altogether if it's really infrequent, relative to
-      // the most frequent.
-      if (position_frequencies[i] < min_position_frequency) {
-        continue;
-      } else {
-        groups_kept++;
-      }
+  if (full) {
+    added = paths;
+    offsets.clear();
+  } else if (added.empty()) {
+    LOG_INFO("%s is up to date\n", bin.c_str());
+    return EXIT_SUCCESS;
+  } else {
+    LOG_DEBUG("adding %d new or appended PGNs to %s\n", added.size(),
+              bin.c_str());
+  }
 
-      // Sort the group.
-      sort(group.begin(), group.end(),
-           [](struct BookEntry *be1, struct BookEntry *be2) {
-             return be1->weight > be2->weight;
-           });
-
-      auto keep_k = min((uint16_t)group.size(), top_k);
-
-      // Now emit the group.
-      out_strm << "#(0x" << hex << group[0]->key << ",[";
-      struct BookEntry *be;
-      // Iterate through all of the group except last
-      for (int j = 0; j < keep_k; j++) {
-        be = group[j];
-        if (group[j]->weight < min_move_frequency) {
-          continue;
-        } else {
-          moves_kept++;
-        }
+  unique_ptr<RunSpiller> spiller;
+  if (opts.memory_budget > 0) {
+    spiller = make_unique<RunSpiller>(opts.memory_budget, opts.tmp_dir);
+  }
 
-        out_strm << "#(0x" << hex << be->move << "," << "0x" << hex
-                 << be->weight << "),";
-      }
+  vector<PGBuilder> pg_builders;
+  if (!parse_books(added, offsets, opts, spiller.get(), pg_builders)) {
+    return EXIT_FAILURE;
+  }
+
+  // The book is only replaced once the new one is complete.
+  string tmp_bin = bin + ".tmp";
+  PGWriter bin_writer;
+  if (!bin_writer.open(tmp_bin)) {
+    return EXIT_FAILURE;
+  }
+  auto write = [&](const struct BookEntry &be) { bin_writer.write(be); };
+
+  if (full) {
+    if (!reduce_book(pg_builders, spiller.get(), opts, write)) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    vector<struct BookEntry> new_entries;
+    bool ok = reduce_book(
+        pg_builders, spiller.get(), opts,
+        [&](const struct BookEntry &be) { new_entries.push_back(be); });
+    pg_builders.clear();
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
 
-      be = group[keep_k - 1];
-      // Last one has no comma in the list of moves. Over a large amount of
-      // tables, this is bound to save a few KB to a few MB.
-      out_strm << "#(0x" << hex << be->move << "," << "0x" << hex << be->weight
-               << ")";
-      // If this is the last group, we'll add the trailing comma (to the outer
-      // list). This will mean we'll have only one unnecessary comma for this
-      // file, which is acceptable.
-      out_strm << "]),";
+    PolyglotFile old_book;
+    if (!old_book.open(bin, MADV_SEQUENTIAL)) {
+      return EXIT_FAILURE;
+    }
+    metrics.entries_read += old_book.size();
+    LOG_DEBUG("merging %d new entries into %d\n", new_entries.size(),
+              old_book.size());
+
+    // Both are sorted and reduced already, so one linear pass does it, and
+    // the old book is merged straight from the file.
+    StageTimer timer(metrics, "merge");
+    PolyglotCursor old_cursor(old_book, MERGE_BUFFER_ENTRIES);
+    VectorCursor new_cursor(new_entries);
+    vector<EntryCursor *> cursors = {&old_cursor, &new_cursor};
+    size_t num_written = 0;
+    merge_entries(cursors, [&](const struct BookEntry &be) {
+      write(be);
+      num_written++;
+    });
+    // The book is what came out of the merge, not the new entries alone.
+    metrics.book_entries = num_written;
+  }
+
+  if (!bin_writer.close()) {
+    return EXIT_FAILURE;
+  }
+  error_code ec;
+  filesystem::rename(tmp_bin, bin, ec);
+  if (ec) {
+    LOG_ERROR("could not replace %s: %s\n", bin.c_str(),
+              ec.message().c_str());
+    return EXIT_FAILURE;
+  }
+
+  // Should this fail, the book won't match the manifest and is rebuilt next
+  // time.
+  uint64_t prefix_hash;
+  if (!hash_file(bin, 0, manifest.book_size, manifest.book_hash,
+                 prefix_hash) ||
+      !write_manifest(manifest_path, manifest)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Build the book for `paths` and generate its code as the book is reduced.
+ * The book is only written out if `bin` is set.
+ */
+int pipeline(vector<string> paths, string out, string bin,
+             struct BuildOptions opts,
+             const struct CodegenOptions &codegen_opts) {
+  ofstream out_strm(out, ios::binary);
+  if (!out_strm.is_open()) {
+    LOG_ERROR("could not open file %s\n", out.c_str());
+    return EXIT_FAILURE;
+  }
+  PGWriter bin_writer;
+  if (!bin.empty() && !bin_writer.open(bin)) {
+    return EXIT_FAILURE;
+  }
+
+  unique_ptr<RunSpiller> spiller;
+  if (opts.memory_budget > 0) {
+    spiller = make_unique<RunSpiller>(opts.memory_budget, opts.tmp_dir);
+  }
+
+  vector<PGBuilder> pg_builders;
+  if (!parse_books(paths, {}, opts, spiller.get(), pg_builders)) {
+    return EXIT_FAILURE;
+  }
+
+  // The book is written out and turned into code as it comes out of the
+  // merge, a position at a time, so it's never held in memory. Codegen time
+  // is counted in the write or merge stage.
+  auto writer = make_table_writer(out_strm, out, codegen_opts);
+  size_t num_entries = 0;
+  bool ok = reduce_book(pg_builders, spiller.get(), opts,
+                        [&](const struct BookEntry &be) {
+                          if (!bin.empty()) {
+                            bin_writer.write(be);
+                          }
+                          writer->add(be);
+                          num_entries++;
+                        });
+  pg_builders.clear();
+  if (!bin.empty()) {
+    ok = bin_writer.close() && ok;
+  }
+  ok = writer->finish() && ok;
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+  if (num_entries == 0) {
+    LOG_ERROR("no entries to generate code from\n");
+    return EXIT_FAILURE;
+  }
+  LOG_DEBUG("peak RSS %.1f MB\n", peak_rss() / 1e6);
+  return EXIT_SUCCESS;
+}
+
+int codegen(string bin, string out, const struct CodegenOptions &opts,
+            int threads) {
+  PolyglotFile book;
+  if (!book.open(bin, MADV_SEQUENTIAL)) {
+    return EXIT_FAILURE;
+  }
+  ofstream out_strm(out, ios::binary);
+  if (!out_strm.is_open()) {
+    LOG_ERROR("could not open file %s\n", out.c_str());
+    return EXIT_FAILURE;
+  }
+  metrics.entries_read += book.size();
+  if (book.size() == 0) {
+    LOG_ERROR("polyglot file has no entries\n");
+    return EXIT_FAILURE;
+  }
+
+  // A sorted book, as every book we write is, is streamed straight through,
+  // a position at a time. Books from elsewhere might not be, and are read
+  // in whole to be sorted first.
+  StageTimer check_timer(metrics, "check");
+  bool sorted = is_sorted_book(book);
+  check_timer.stop();
+  vector<struct BookEntry> entries;
+  if (!sorted) {
+    StageTimer read_timer(metrics, "read");
+    book.decode_all(entries);
+    read_timer.stop();
+    StageTimer timer(metrics, "sort");
+    sort_and_reduce(entries, threads);
+  }
+
+  StageTimer codegen_timer(metrics, "codegen");
+  auto writer = make_table_writer(out_strm, out, opts);
+  size_t num_entries = 0;
+  if (sorted) {
+    PolyglotCursor cursor(book, MERGE_BUFFER_ENTRIES);
+    for (; !cursor.done(); cursor.advance()) {
+      writer->add(cursor.peek());
+      num_entries++;
     }
-    out_strm << "]" << endl;
-    LOG_DEBUG("kept %ld groups\n", groups_kept);
-    LOG_DEBUG("kept %ld moves\n", moves_kept);
+  } else {
+    for (auto &be : entries) {
+      writer->add(be);
+    }
+    num_entries = entries.size();
+  }
+  bool ok = writer->finish();
+  codegen_timer.stop();
+  if (!ok) {
+    return EXIT_FAILURE;
   }
+  metrics.book_entries = num_entries;
+  LOG_DEBUG("generated code from %ld reduced entries\n", num_entries);
 
   out_strm.close();
-  bin_strm.close();
+  book.close();
+  LOG_DEBUG("peak RSS %.1f MB\n", peak_rss() / 1e6);
 
   return EXIT_SUCCESS;
 }
 
-int merge(vector<string> bins, string out_bin) {
-  ofstream out_strm(out_bin, ios::binary);
-  if (!out_strm) {
-    LOG_ERROR("could not open file %s\n", out_bin.c_str());
+int merge(vector<string> bins, string out_bin, size_t memory_budget,
+          string tmp_dir, int threads) {
+  PGWriter out_writer;
+  if (!out_writer.open(out_bin)) {
     return EXIT_FAILURE;
   }
-  vector<ifstream> bin_strms;
-  for (auto &bin : bins) {
-    ifstream bin_strm(bin);
-    if (!bin_strm) {
-      LOG_ERROR("could not open file %s\n", bin.c_str());
+  vector<PolyglotFile> books(bins.size());
+  size_t total_entries = 0;
+  for (size_t i = 0; i < bins.size(); i++) {
+    if (!books[i].open(bins[i], MADV_SEQUENTIAL)) {
+      return EXIT_FAILURE;
+    }
+    total_entries += books[i].size();
+  }
+
+  // Books we wrote are sorted and reduced, and so are most others. Those
+  // are merged straight from the files, a block of each at a time.
+  StageTimer check_timer(metrics, "check");
+  bool all_sorted = true;
+  for (size_t i = 0; i < books.size() && all_sorted; i++) {
+    if (!is_sorted_book(books[i])) {
+      LOG_INFO("%s isn't sorted, sorting all books\n", bins[i].c_str());
+      all_sorted = false;
+    }
+  }
+  check_timer.stop();
+  if (all_sorted) {
+    StageTimer merge_timer(metrics, "merge");
+    vector<unique_ptr<PolyglotCursor>> book_cursors;
+    vector<EntryCursor *> cursors;
+    for (auto &book : books) {
+      book_cursors.push_back(
+          make_unique<PolyglotCursor>(book, MERGE_BUFFER_ENTRIES));
+      cursors.push_back(book_cursors.back().get());
+    }
+    size_t num_written = 0;
+    merge_entries(cursors, [&](const struct BookEntry &be) {
+      out_writer.write(be);
+      num_written++;
+    });
+    metrics.entries_read = total_entries;
+    metrics.book_entries = num_written;
+    LOG_DEBUG("merged %d entries into %d\n", total_entries, num_written);
+    return out_writer.close() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // With a memory budget, read the inputs a budget's worth at a time and
+  // spill whatever doesn't fit into runs.
+  if (memory_budget > 0) {
+    RunSpiller spiller(memory_budget, tmp_dir);
+    size_t buffer_entries =
+        max(memory_budget / sizeof(struct BookEntry), (size_t)1);
+
+    vector<vector<struct BookEntry>> tails(1);
+    auto &buffer = tails[0];
+    buffer.reserve(buffer_entries);
+    StageTimer read_timer(metrics, "read");
+    for (auto &book : books) {
+      for (size_t start = 0; start < book.size();) {
+        size_t count = min(book.size() - start, buffer_entries - buffer.size());
+        size_t size = buffer.size();
+        buffer.resize(size + count);
+        book.decode(start, count, buffer.data() + size);
+        start += count;
+        metrics.entries_read += count;
+        if (buffer.size() == buffer_entries && !spiller.spill(buffer)) {
+          return EXIT_FAILURE;
+        }
+      }
+      book.close();
+    }
+    read_timer.stop();
+
+    StageTimer merge_timer(metrics, "merge");
+    size_t num_written = 0;
+    bool ok = spiller.merge(tails, [&](const struct BookEntry &be) {
+      out_writer.write(be);
+      num_written++;
+    });
+    if (!ok || !out_writer.close()) {
       return EXIT_FAILURE;
     }
-    bin_strms.emplace_back(std::move(bin_strm));
+    metrics.book_entries = num_written;
+    LOG_DEBUG("wrote %d entries\n", num_written);
+
+    return EXIT_SUCCESS;
   }
 
   // Load all entries and then sort them
-  // TODO: Do a k-way merge instead. It should be faster
+  StageTimer read_timer(metrics, "read");
   vector<struct BookEntry> all_entries;
-  for (auto &bin_strm : bin_strms) {
-    auto entries = read_pg_file(bin_strm);
-    all_entries.insert(all_entries.end(), entries.begin(), entries.end());
+  all_entries.reserve(total_entries);
+  for (auto &book : books) {
+    book.decode_all(all_entries);
+    book.close();
   }
+  read_timer.stop();
+  metrics.entries_read = all_entries.size();
 
   LOG_DEBUG("read a total of %d entries\n", all_entries.size());
-  sort(all_entries.begin(), all_entries.end());
-  auto reduced_entries = reduce_to_normal_form(all_entries);
-  all_entries.clear();
+  StageTimer sort_timer(metrics, "sort");
+  sort_and_reduce(all_entries, threads);
+  sort_timer.stop();
+  metrics.book_entries = all_entries.size();
 
-  LOG_DEBUG("reduced to %d entries\n", reduced_entries.size());
+  LOG_DEBUG("reduced to %d entries\n", all_entries.size());
 
   LOG_DEBUG("writing to file\n");
-  write_pg_file(out_strm, reduced_entries);
+  StageTimer write_timer(metrics, "write");
+  out_writer.write(all_entries.data(), all_entries.size());
+  return out_writer.close() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-  for (auto &bin_strm : bin_strms) {
-    bin_strm.close();
+int gen_pgn(string out, const struct PgnGenOptions &opts, int threads) {
+  ofstream out_strm;
+  if (out != "-") {
+    out_strm.open(out, ios::binary);
+    if (!out_strm.is_open()) {
+      LOG_ERROR("could not open file %s\n", out.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+  ostream &strm = out == "-" ? cout : out_strm;
+
+  StageTimer timer(metrics, "generate");
+  if (!generate_pgn(strm, opts, threads)) {
+    LOG_ERROR("could not write %s\n", out.c_str());
+    return EXIT_FAILURE;
+  }
+  strm.flush();
+  size_t bytes = strm.tellp() > 0 ? (size_t)strm.tellp() : 0;
+  double seconds = timer.stop();
+  if (bytes > 0) {
+    LOG_DEBUG("generated %d games, %.1f MB in %.2fs (%.1f MB/s)\n",
+              opts.games, bytes / 1e6, seconds, bytes / 1e6 / seconds);
   }
-  out_strm.close();
   return EXIT_SUCCESS;
 }
 
-int main(int argc, char **argv) {
-  argparse::ArgumentParser build_command("build");
-  build_command.add_description("Generate Polyglot file from PGN");
-  build_command.add_argument("--pgn").required().help("PGN file to load from");
-  build_command.add_argument("--bin")
-      .default_value("polyglot.bin")
-      .help("Polyglot file to output to");
-  build_command.add_argument("--max-plies")
+// Options shared by build and build-all.
+static void add_build_arguments(argparse::ArgumentParser &command) {
+  command.add_argument("--max-plies")
       .default_value(16)
       .scan<'i', int>()
       .help("Max plies to take from each game");
-  build_command.add_argument("--elo-cutoff")
+  command.add_argument("--elo-cutoff")
       .default_value(2200)
       .scan<'i', int>()
       .help("If ELO headers are present in PGN, the minimum ELO to keep games");
-  build_command.add_argument("--max-elo-diff")
+  command.add_argument("--max-elo-diff")
       .default_value(200)
       .scan<'i', int>()
       .help("If ELO headers are present in PGN, the maximum ELO difference "
             "between players to keep games. This is to prevent, e.g. friendly "
             "games, from being processed");
+  command.add_argument("--memory-budget")
+      .default_value(0)
+      .scan<'i', int>()
+      .help("Memory to hold entries in, in MiB. Beyond that, entries are "
+            "sorted and spilled to temporary files, which are merged at the "
+            "end. 0 for no limit");
+  command.add_argument("--tmp-dir")
+      .default_value(filesystem::temp_directory_path().string())
+      .help("Directory to spill entries to");
+  command.add_argument("--aggregate")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Aggregate weights by position and move while parsing, so that "
+            "memory grows with distinct moves rather than plies");
+  command.add_argument("--replay-cache")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Reuse the moves of openings seen in earlier games, rather than "
+            "replaying every move on the board");
+  command.add_argument("--dedup")
+      .default_value("off")
+      .choices("off", "games", "openings")
+      .help("Drop duplicate games: games with the same moves and result, or "
+            "openings with the same moves up to --max-plies and result. "
+            "Duplicates aren't replayed");
+  command.add_argument("--dedup-filter")
+      .default_value(0)
+      .scan<'i', int>()
+      .help("Track games for --dedup in a Bloom filter of this many MiB, "
+            "which may take a few unique games for duplicates, rather than "
+            "exactly. 0 to track them exactly");
+}
 
-  argparse::ArgumentParser codegen_command("codegen");
-  codegen_command.add_description("Generate gleam code");
-  codegen_command.add_argument("--bin").required().help(
-      "Polyglot file to read from");
-  codegen_command.add_argument("--output").required().help("Codegen output");
-  codegen_command.add_argument("--min-position-frequency")
+static struct BuildOptions
+get_build_options(const argparse::ArgumentParser &command) {
+  struct BuildOptions opts;
+  opts.elo_cutoff = command.get<int>("--elo-cutoff");
+  opts.max_elo_diff = command.get<int>("--max-elo-diff");
+  opts.max_plies = command.get<int>("--max-plies");
+  opts.use_mmap = true;
+  opts.threads = command.get<int>("--threads");
+  opts.memory_budget = (size_t)command.get<int>("--memory-budget") << 20;
+  opts.tmp_dir = command.get("--tmp-dir");
+  opts.aggregate = command.get<bool>("--aggregate");
+  opts.memoize = command.get<bool>("--replay-cache");
+  string dedup = command.get("--dedup");
+  opts.dedup = dedup == "games"      ? Dedup::Games
+               : dedup == "openings" ? Dedup::Openings
+                                     : Dedup::Off;
+  opts.dedup_filter_bytes = (size_t)command.get<int>("--dedup-filter") << 20;
+  opts.staged = false;
+  opts.queue_depth = 16;
+  return opts;
+}
+
+// Options shared by codegen and pipeline.
+static void add_codegen_arguments(argparse::ArgumentParser &command) {
+  command.add_argument("--min-position-frequency")
       .default_value(2)
       .scan<'i', int32_t>()
       .help("The minimum frequency per million of a position to keep. The "
             "frequency of a position is calculated by the sum of all the "
             "weights of moves for a position.");
-  codegen_command.add_argument("--min-move-frequency")
+  command.add_argument("--min-move-frequency")
       .default_value(2)
       .scan<'i', int32_t>()
       .help("The minimum weight/frequency of a move to keep.");
-  codegen_command.add_argument("--top-k")
+  command.add_argument("--top-k")
       .default_value(4)
       .scan<'i', int32_t>()
       .help("Keep only the top k moves for a position");
+  command.add_argument("--format")
+      .default_value("gleam")
+      .choices("gleam", "etf", "case", "bits")
+      .help("Write the table as a Gleam module with the table as a list, as "
+            "an Erlang map in the external term format to be loaded with "
+            "binary_to_term, or as a Gleam module with a lookup_move "
+            "function that cases on the key (case) or binary searches the "
+            "table packed into binaries (bits)");
+  command.add_argument("--shards")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Split a Gleam table into this many case tables by key, next "
+            "to a module at --output that looks keys up in them. Shards are "
+            "only loaded once a key in them is looked up");
+  command.add_argument("--module")
+      .default_value("chess/tablebase/data")
+      .help("The Gleam module --output is, to import its shards by");
+}
+
+static struct CodegenOptions
+get_codegen_options(const argparse::ArgumentParser &command) {
+  struct CodegenOptions opts;
+  opts.min_position_frequency =
+      command.get<int32_t>("--min-position-frequency");
+  opts.min_move_frequency = command.get<int32_t>("--min-move-frequency");
+  opts.top_k = command.get<int32_t>("--top-k");
+  string format = command.get("--format");
+  opts.format = format == "etf"    ? CodegenFormat::Etf
+                : format == "case" ? CodegenFormat::Case
+                : format == "bits" ? CodegenFormat::Bits
+                                   : CodegenFormat::Gleam;
+  opts.shards = max(command.get<int>("--shards"), 1);
+  opts.module = command.get("--module");
+  return opts;
+}
+
+int main(int argc, char **argv) {
+  argparse::ArgumentParser build_command("build");
+  build_command.add_description("Generate Polyglot file from PGN");
+  build_command.add_argument("--pgn").required().help(
+      "PGN file to load from. May be gzip or zstd compressed, or - for stdin");
+  build_command.add_argument("--bin")
+      .default_value("polyglot.bin")
+      .help("Polyglot file to output to");
+  build_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to parse the PGN and sort entries with. The "
+            "PGN is split into one range of games per thread, unless it's "
+            "parsed --staged");
+  add_build_arguments(build_command);
+  build_command.add_argument("--no-mmap")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Read the PGN through a stream instead of mapping it into memory. "
+            "With more than one thread, implies --staged");
+  build_command.add_argument("--staged")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Tokenize the PGN on one thread and replay its moves on --threads "
+            "others, rather than splitting it. Compressed PGNs and stdin are "
+            "always parsed this way with more than one thread");
+  build_command.add_argument("--queue-depth")
+      .default_value(16)
+      .scan<'i', int>()
+      .help("Batches of games, or of their entries, queued between the "
+            "stages of a --staged parse");
+  build_command.add_argument("--incremental")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Only parse what's new since the last incremental build of the "
+            "Polyglot file, and merge it in. What went into the file is kept "
+            "in a manifest next to it");
+
+  argparse::ArgumentParser build_all_command("build-all");
+  build_all_command.add_description(
+      "Generate one Polyglot file from a directory of PGNs");
+  build_all_command.add_argument("--books-dir")
+      .required()
+      .help("Directory of PGN files to load from. They may be gzip or zstd "
+            "compressed");
+  build_all_command.add_argument("--bin")
+      .default_value("polyglot.bin")
+      .help("Polyglot file to output to");
+  build_all_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to parse PGNs and sort entries with. Books "
+            "are handed out largest first, and large books are split so that "
+            "idle threads can take parts of them");
+  add_build_arguments(build_all_command);
+  build_all_command.add_argument("--incremental")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Only parse what's new since the last incremental build of the "
+            "Polyglot file, and merge it in. What went into the file is kept "
+            "in a manifest next to it");
+
+  argparse::ArgumentParser codegen_command("codegen");
+  codegen_command.add_description("Generate gleam code");
+  codegen_command.add_argument("--bin").required().help(
+      "Polyglot file to read from");
+  codegen_command.add_argument("--output").required().help("Codegen output");
+  add_codegen_arguments(codegen_command);
+  codegen_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to sort entries with");
+
+  argparse::ArgumentParser pipeline_command("pipeline");
+  pipeline_command.add_description(
+      "Generate gleam code from PGNs, without intermediate Polyglot files");
+  pipeline_command.add_argument("--pgns").nargs(1, 256).help(
+      "PGN files to load from. They may be gzip or zstd compressed");
+  pipeline_command.add_argument("--books-dir").help(
+      "Directory of PGN files to load from, instead of or as well as --pgns");
+  pipeline_command.add_argument("--output").required().help("Codegen output");
+  pipeline_command.add_argument("--bin").default_value("").help(
+      "Also write the Polyglot file to this path");
+  pipeline_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to parse PGNs and sort entries with");
+  add_build_arguments(pipeline_command);
+  add_codegen_arguments(pipeline_command);
+
+  argparse::ArgumentParser gen_pgn_command("gen-pgn");
+  gen_pgn_command.add_description(
+      "Generate a corpus of random legal games, the same for the same seed");
+  gen_pgn_command.add_argument("--output").required().help(
+      "PGN file to write to, or - for stdout");
+  gen_pgn_command.add_argument("--games")
+      .default_value(100000)
+      .scan<'i', int>()
+      .help("Number of games to generate");
+  gen_pgn_command.add_argument("--seed")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Seed of the corpus. Every seed gives a different corpus");
+  gen_pgn_command.add_argument("--min-plies")
+      .default_value(20)
+      .scan<'i', int>()
+      .help("Games that don't end by themselves are at least this long");
+  gen_pgn_command.add_argument("--max-plies")
+      .default_value(160)
+      .scan<'i', int>()
+      .help("Games are at most this long");
+  gen_pgn_command.add_argument("--opening-plies")
+      .default_value(12)
+      .scan<'i', int>()
+      .help("Plies at the start of each game that follow a shared opening "
+            "tree, where a few moves are far more likely than the others");
+  gen_pgn_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to generate games with. The output doesn't "
+            "depend on it");
 
   argparse::ArgumentParser merge_command("merge");
-  merge_command.add_description("Merge Polyglot files");
+  merge_command.add_description(
+      "Merge Polyglot files. Sorted files, like the ones we write, are "
+      "merged as they're read, in little memory");
   merge_command.add_argument("--bins").nargs(1, 256).required().help(
       "Polyglot files to merge");
   merge_command.add_argument("--output").required().help("File to merge into");
+  merge_command.add_argument("--memory-budget")
+      .default_value(0)
+      .scan<'i', int>()
+      .help("Memory to hold entries of unsorted files in, in MiB. Beyond "
+            "that, entries are sorted and spilled to temporary files, which "
+            "are merged at the end. 0 for no limit");
+  merge_command.add_argument("--tmp-dir")
+      .default_value(filesystem::temp_directory_path().string())
+      .help("Directory to spill entries to");
+  merge_command.add_argument("--threads")
+      .default_value(1)
+      .scan<'i', int>()
+      .help("Number of threads to sort entries with");
 
   int verbosity = 0;
   argparse::ArgumentParser program("polyglot-operator");
   program.add_subparser(build_command);
+  program.add_subparser(build_all_command);
   program.add_subparser(codegen_command);
+  program.add_subparser(pipeline_command);
+  program.add_subparser(gen_pgn_command);
   program.add_subparser(merge_command);
   program.add_argument("-v", "--verbose")
       .action([&](const auto &) { ++verbosity; })
@@ -294,6 +1272,11 @@ int main(int argc, char **argv) {
       .default_value(false)
       .implicit_value(true)
       .nargs(0);
+  program.add_argument("--metrics-json")
+      .help("Write what was counted and timed to this file as JSON: games, "
+            "plies and input MB per second, games filtered out, SAN errors, "
+            "entries before and after reducing, and the wall time of each "
+            "stage");
 
   try {
     program.parse_args(argc, argv);
@@ -313,29 +1296,109 @@ int main(int argc, char **argv) {
     break;
   }
 
-  if (program.is_subcommand_used(build_command)) {
-    string pgn = build_command.get("--pgn");
-    string bin = build_command.get("--bin");
-    auto elo_cutoff = build_command.get<int>("--elo-cutoff");
-    auto max_elo_diff = build_command.get<int>("--max-elo-diff");
-    auto max_plies = build_command.get<int>("--max-plies");
-    return build(pgn, bin, max_plies, elo_cutoff, max_elo_diff);
-  } else if (program.is_subcommand_used(codegen_command)) {
-    string bin = codegen_command.get("--bin");
-    string out = codegen_command.get("--output");
-    auto min_position_frequency =
-        codegen_command.get<int32_t>("--min-position-frequency");
-    auto min_move_frequency =
-        codegen_command.get<int32_t>("--min-move-frequency");
-    auto top_k = codegen_command.get<int32_t>("--top-k");
-    return codegen(bin, out, min_position_frequency, min_move_frequency, top_k);
-  } else if (program.is_subcommand_used(merge_command)) {
-    auto bins = merge_command.get<vector<string>>("--bins");
-    string out = merge_command.get("--output");
-    return merge(bins, out);
-  } else {
-    cerr << program << endl;
-    cerr << "Need subcommand" << endl;
+  // Returns the exit status, with `command` set to the subcommand run.
+  auto run = [&](string &command) -> int {
+    if (program.is_subcommand_used(build_command)) {
+      command = "build";
+      string pgn = build_command.get("--pgn");
+      string bin = build_command.get("--bin");
+      struct BuildOptions opts = get_build_options(build_command);
+      opts.use_mmap = !build_command.get<bool>("--no-mmap");
+      opts.staged = build_command.get<bool>("--staged");
+      opts.queue_depth = build_command.get<int>("--queue-depth");
+      if (build_command.get<bool>("--incremental")) {
+        if (pgn == "-") {
+          LOG_ERROR("can't build incrementally from stdin\n");
+          return EXIT_FAILURE;
+        }
+        return build_incremental({pgn}, bin, opts);
+      }
+      return build(pgn, bin, opts);
+    } else if (program.is_subcommand_used(build_all_command)) {
+      command = "build-all";
+      string books_dir = build_all_command.get("--books-dir");
+      string bin = build_all_command.get("--bin");
+      struct BuildOptions opts = get_build_options(build_all_command);
+      if (build_all_command.get<bool>("--incremental")) {
+        vector<string> paths;
+        if (!list_books(books_dir, paths)) {
+          return EXIT_FAILURE;
+        }
+        return build_incremental(paths, bin, opts);
+      }
+      return build_all(books_dir, bin, opts);
+    } else if (program.is_subcommand_used(codegen_command)) {
+      command = "codegen";
+      string bin = codegen_command.get("--bin");
+      string out = codegen_command.get("--output");
+      struct CodegenOptions opts = get_codegen_options(codegen_command);
+      auto threads = codegen_command.get<int>("--threads");
+      return codegen(bin, out, opts, threads);
+    } else if (program.is_subcommand_used(pipeline_command)) {
+      command = "pipeline";
+      vector<string> paths;
+      if (pipeline_command.is_used("--pgns")) {
+        paths = pipeline_command.get<vector<string>>("--pgns");
+      }
+      if (pipeline_command.is_used("--books-dir") &&
+          !list_books(pipeline_command.get("--books-dir"), paths)) {
+        return EXIT_FAILURE;
+      }
+      if (paths.empty()) {
+        cerr << pipeline_command << endl;
+        cerr << "Need --pgns or --books-dir" << endl;
+        return EXIT_FAILURE;
+      }
+      string out = pipeline_command.get("--output");
+      string bin = pipeline_command.get("--bin");
+      struct BuildOptions opts = get_build_options(pipeline_command);
+      struct CodegenOptions codegen_opts =
+          get_codegen_options(pipeline_command);
+      return pipeline(paths, out, bin, opts, codegen_opts);
+    } else if (program.is_subcommand_used(gen_pgn_command)) {
+      command = "gen-pgn";
+      struct PgnGenOptions opts;
+      opts.seed = gen_pgn_command.get<int>("--seed");
+      opts.games = gen_pgn_command.get<int>("--games");
+      opts.min_plies = gen_pgn_command.get<int>("--min-plies");
+      opts.max_plies = gen_pgn_command.get<int>("--max-plies");
+      opts.opening_plies = gen_pgn_command.get<int>("--opening-plies");
+      opts.comment_rate = 30;
+      opts.nag_rate = 20;
+      opts.variation_rate = 10;
+      if (opts.min_plies < 0 || opts.max_plies < opts.min_plies) {
+        LOG_ERROR("need 0 <= --min-plies <= --max-plies\n");
+        return EXIT_FAILURE;
+      }
+      string out = gen_pgn_command.get("--output");
+      auto threads = gen_pgn_command.get<int>("--threads");
+      return gen_pgn(out, opts, threads);
+    } else if (program.is_subcommand_used(merge_command)) {
+      command = "merge";
+      auto bins = merge_command.get<vector<string>>("--bins");
+      string out = merge_command.get("--output");
+      auto memory_budget =
+          (size_t)merge_command.get<int>("--memory-budget") << 20;
+      string tmp_dir = merge_command.get("--tmp-dir");
+      auto threads = merge_command.get<int>("--threads");
+      return merge(bins, out, memory_budget, tmp_dir, threads);
+    } else {
+      cerr << program << endl;
+      cerr << "Need subcommand" << endl;
+      return EXIT_FAILURE;
+    }
+  };
+
+  // Progress lines go to stderr every few seconds, at the default log level.
+  metrics.start_progress(chrono::seconds(5));
+  string command;
+  int status = run(command);
+  metrics.stop_progress();
+  metrics.log_summary();
+
+  if (program.is_used("--metrics-json") && !command.empty() &&
+      !metrics.write_json(program.get("--metrics-json"), command)) {
     return EXIT_FAILURE;
   }
+  return status;
 }
@@ -0,0 +1,149 @@
+#include "manifest.h"
+#include "mapped_file.h"
+#include "tinylogger.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+
+static const char *MANIFEST_HEADER = "polyglot-operator manifest 1";
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+void ContentHash::mix(uint64_t word) {
+  state = rotl(state ^ (word * 0x9E3779B97F4A7C15ULL), 29) *
+          0xBF58476D1CE4E5B9ULL;
+}
+
+void ContentHash::update(string_view data) {
+  total += data.size();
+
+  // Top up a partial word from last time first.
+  while (num_pending > 0 && num_pending < 8 && !data.empty()) {
+    pending[num_pending++] = data[0];
+    data.remove_prefix(1);
+  }
+  if (num_pending == 8) {
+    uint64_t word;
+    memcpy(&word, pending, 8);
+    mix(word);
+    num_pending = 0;
+  }
+
+  while (data.size() >= 8) {
+    uint64_t word;
+    memcpy(&word, data.data(), 8);
+    mix(word);
+    data.remove_prefix(8);
+  }
+
+  memcpy(pending + num_pending, data.data(), data.size());
+  num_pending += data.size();
+}
+
+uint64_t ContentHash::digest() const {
+  uint64_t h = state;
+  for (size_t i = 0; i < num_pending; i++) {
+    h = rotl(h ^ (pending[i] * 0x9E3779B97F4A7C15ULL), 29) *
+        0xBF58476D1CE4E5B9ULL;
+  }
+  // The length tells apart inputs that only differ by trailing zero bytes.
+  h ^= total;
+  h ^= h >> 31;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 29;
+  return h;
+}
+
+bool read_manifest(const string &path, struct Manifest &manifest) {
+  ifstream strm(path);
+  if (!strm.is_open()) {
+    return false;
+  }
+
+  string line;
+  if (!getline(strm, line) || line != MANIFEST_HEADER) {
+    LOG_WARNING("%s is not a manifest, ignoring it\n", path.c_str());
+    return false;
+  }
+
+  manifest = Manifest();
+  while (getline(strm, line)) {
+    istringstream fields(line);
+    string kind;
+    fields >> kind;
+    if (kind == "options") {
+      getline(fields >> ws, manifest.options);
+    } else if (kind == "book") {
+      fields >> manifest.book_size >> hex >> manifest.book_hash;
+    } else if (kind == "input") {
+      struct ManifestInput input;
+      fields >> input.size >> hex >> input.hash;
+      getline(fields >> ws, input.path);
+      manifest.inputs.push_back(input);
+    }
+    if (fields.fail()) {
+      LOG_WARNING("bad line in manifest %s, ignoring it\n", path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool write_manifest(const string &path, const struct Manifest &manifest) {
+  string tmp_path = path + ".tmp";
+  ofstream strm(tmp_path);
+  if (!strm.is_open()) {
+    LOG_ERROR("could not open file %s\n", tmp_path.c_str());
+    return false;
+  }
+
+  strm << MANIFEST_HEADER << "\n";
+  strm << "options " << manifest.options << "\n";
+  strm << "book " << manifest.book_size << " " << hex << manifest.book_hash
+       << dec << "\n";
+  for (auto &input : manifest.inputs) {
+    strm << "input " << input.size << " " << hex << input.hash << dec << " "
+         << input.path << "\n";
+  }
+  strm.close();
+  if (strm.fail()) {
+    LOG_ERROR("could not write file %s\n", tmp_path.c_str());
+    return false;
+  }
+
+  error_code ec;
+  filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    LOG_ERROR("could not replace %s: %s\n", path.c_str(),
+              ec.message().c_str());
+    return false;
+  }
+  return true;
+}
+
+bool hash_file(const string &path, uint64_t prefix, uint64_t &size,
+               uint64_t &hash, uint64_t &prefix_hash) {
+  MappedFile file;
+  if (!file.open(path, MADV_SEQUENTIAL)) {
+    return false;
+  }
+
+  string_view data = file.view();
+  ContentHash content_hash;
+  if (prefix > 0 && prefix <= data.size()) {
+    content_hash.update(data.substr(0, prefix));
+    prefix_hash = content_hash.digest();
+    data.remove_prefix(prefix);
+  }
+  content_hash.update(data);
+
+  size = content_hash.length();
+  hash = content_hash.digest();
+  return true;
+}
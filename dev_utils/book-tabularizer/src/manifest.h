@@ -0,0 +1,65 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+/*
+ * A 64-bit hash of a byte stream, fed in any number of pieces. The digest
+ * only depends on the bytes, not on how they were split, so the hash of a
+ * prefix of a file is available on the way to the hash of the whole file.
+ */
+class ContentHash {
+public:
+  void update(string_view data);
+
+  // Hash of everything so far. Doesn't stop further updates.
+  uint64_t digest() const;
+
+  uint64_t length() const { return total; }
+
+private:
+  void mix(uint64_t word);
+
+  uint64_t state = 0x243F6A8885A308D3ULL;
+  uint64_t total = 0;
+  // Bytes of a word not yet mixed in.
+  uint8_t pending[8];
+  size_t num_pending = 0;
+};
+
+struct ManifestInput {
+  string path;
+  uint64_t size;
+  uint64_t hash;
+};
+
+/*
+ * What went into a book: the options it was built with, and every PGN with
+ * its size and content hash. The book itself is recorded too, so that a
+ * manifest that doesn't belong to the book next to it is noticed.
+ */
+struct Manifest {
+  string options;
+  uint64_t book_size = 0;
+  uint64_t book_hash = 0;
+  vector<struct ManifestInput> inputs;
+};
+
+bool read_manifest(const string &path, struct Manifest &manifest);
+
+// Written to a temporary file first, which then replaces `path`.
+bool write_manifest(const string &path, const struct Manifest &manifest);
+
+/*
+ * Hash all of the file at `path`. If `prefix` isn't 0 and no larger than
+ * the file, `prefix_hash` is set to the hash of its first `prefix` bytes.
+ */
+bool hash_file(const string &path, uint64_t prefix, uint64_t &size,
+               uint64_t &hash, uint64_t &prefix_hash);
+
+#endif /* _MANIFEST_H_ */
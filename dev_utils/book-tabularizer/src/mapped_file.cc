@@ -0,0 +1,72 @@
+#include "mapped_file.h"
+#include "tinylogger.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() {}
+
+MappedFile::MappedFile(MappedFile &&other)
+    : addr(other.addr), length(other.length) {
+  other.addr = nullptr;
+  other.length = 0;
+}
+
+MappedFile::~MappedFile() { close(); }
+
+bool MappedFile::open(const string &path, int advice) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("could not open file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR("could not stat file %s: %s\n", path.c_str(), strerror(errno));
+    ::close(fd);
+    return false;
+  }
+
+  // mmap refuses empty mappings, but an empty file is still a valid input.
+  if (st.st_size == 0) {
+    ::close(fd);
+    return true;
+  }
+
+  void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps its own reference to the file.
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG_ERROR("could not map file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Only a hint, so failing here isn't fatal.
+  if (madvise(mapped, st.st_size, advice) < 0) {
+    LOG_WARNING("madvise failed for %s: %s\n", path.c_str(), strerror(errno));
+  }
+
+  addr = mapped;
+  length = st.st_size;
+  return true;
+}
+
+void MappedFile::close() {
+  if (addr != nullptr) {
+    munmap(addr, length);
+  }
+  addr = nullptr;
+  length = 0;
+}
+
+string_view MappedFile::view() const {
+  return string_view((const char *)addr, length);
+}
+
+size_t MappedFile::size() const { return length; }
@@ -0,0 +1,42 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/*
+ * Read-only mapping of an entire file. The mapping is released when the
+ * object is destroyed, so views handed out must not outlive it.
+ */
+class MappedFile {
+public:
+  MappedFile();
+
+  MappedFile(MappedFile &&other);
+
+  MappedFile(const MappedFile &) = delete;
+
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile();
+
+  /*
+   * Map the whole file. `advice` is passed on to madvise(2), e.g.
+   * MADV_SEQUENTIAL for a single front-to-back scan.
+   */
+  bool open(const string &path, int advice);
+
+  void close();
+
+  string_view view() const;
+
+  size_t size() const;
+
+private:
+  void *addr = nullptr;
+  size_t length = 0;
+};
+
+#endif /* _MAPPED_FILE_H_ */
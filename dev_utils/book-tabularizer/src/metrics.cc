@@ -0,0 +1,173 @@
+#include "metrics.h"
+#include "tinylogger.h"
+#include "util.h"
+#include <cstdio>
+
+Metrics::Metrics() : start(chrono::steady_clock::now()) {}
+
+Metrics::~Metrics() { stop_progress(); }
+
+void Metrics::add(const struct ParseCounters &counters) {
+  games += counters.games;
+  plies += counters.plies;
+  elo_rejected += counters.elo_rejected;
+  ply_limited += counters.ply_limited;
+  san_errors += counters.san_errors;
+  unique_games += counters.unique_games;
+  duplicate_games += counters.duplicate_games;
+}
+
+void Metrics::add_stage(const string &stage, double seconds) {
+  for (auto &[name, total] : stages) {
+    if (name == stage) {
+      total += seconds;
+      return;
+    }
+  }
+  stages.emplace_back(stage, seconds);
+}
+
+void Metrics::add_queue(const string &name, const struct QueueStats &stats) {
+  queues.emplace_back(name, stats);
+}
+
+void Metrics::start_progress(chrono::seconds interval) {
+  stopping = false;
+  progress = thread([this, interval]() {
+    auto progress_start = chrono::steady_clock::now();
+    unique_lock<mutex> lock(progress_mtx);
+    while (!progress_cv.wait_for(lock, interval, [&] { return stopping; })) {
+      chrono::duration<double> elapsed =
+          chrono::steady_clock::now() - progress_start;
+      double seconds = elapsed.count();
+      LOG_INFO("%llu games (%.0f/s), %llu plies (%.0f/s), %.1f MB of PGN "
+               "(%.1f MB/s)\n",
+               (unsigned long long)games, games / seconds,
+               (unsigned long long)plies, plies / seconds, bytes_parsed / 1e6,
+               bytes_parsed / 1e6 / seconds);
+    }
+  });
+}
+
+void Metrics::stop_progress() {
+  if (!progress.joinable()) {
+    return;
+  }
+  {
+    lock_guard<mutex> lock(progress_mtx);
+    stopping = true;
+  }
+  progress_cv.notify_all();
+  progress.join();
+}
+
+double Metrics::parse_seconds() const {
+  for (auto &[name, total] : stages) {
+    if (name == "parse") {
+      return total;
+    }
+  }
+  return 0;
+}
+
+void Metrics::log_summary() const {
+  double seconds = parse_seconds();
+  if (games > 0 && seconds > 0) {
+    LOG_INFO("%llu games (%.0f/s), %llu plies (%.0f/s), %.1f MB/s of PGN\n",
+             (unsigned long long)games, games / seconds,
+             (unsigned long long)plies, plies / seconds,
+             bytes_parsed / 1e6 / seconds);
+    LOG_INFO("rejected %llu games by elo, cut %llu at the ply limit, %llu "
+             "SAN errors\n",
+             (unsigned long long)elo_rejected,
+             (unsigned long long)ply_limited,
+             (unsigned long long)san_errors);
+  }
+  for (auto &[name, total] : stages) {
+    LOG_INFO("%s took %.2fs\n", name.c_str(), total);
+  }
+  // A stage that keeps its input queue empty is the bottleneck, one that
+  // keeps its output queue full is waiting on the next stage. Only of use
+  // when tuning, so these need -v.
+  for (auto &[name, stats] : queues) {
+    LOG_DEBUG("%s queue: %.1f of %zu deep on average (%zu at most), "
+              "producers waited %.2fs, consumers %.2fs\n",
+              name.c_str(), stats.mean_depth, stats.capacity, stats.max_depth,
+              stats.push_stall_seconds, stats.pop_stall_seconds);
+  }
+}
+
+bool Metrics::write_json(const string &path, const string &command) const {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    LOG_ERROR("could not open file %s\n", path.c_str());
+    return false;
+  }
+
+  chrono::duration<double> wall = chrono::steady_clock::now() - start;
+  double seconds = parse_seconds();
+  auto rate = [&](double n) { return seconds > 0 ? n / seconds : 0; };
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"command\": \"%s\",\n", command.c_str());
+  fprintf(file, "  \"wall_seconds\": %.3f,\n", wall.count());
+  fprintf(file, "  \"peak_rss_bytes\": %zu,\n", peak_rss());
+  fprintf(file, "  \"games\": %llu,\n", (unsigned long long)games);
+  fprintf(file, "  \"games_per_second\": %.1f,\n", rate(games));
+  fprintf(file, "  \"plies\": %llu,\n", (unsigned long long)plies);
+  fprintf(file, "  \"plies_per_second\": %.1f,\n", rate(plies));
+  fprintf(file, "  \"input_bytes\": %llu,\n", (unsigned long long)bytes_parsed);
+  fprintf(file, "  \"input_mb_per_second\": %.2f,\n",
+          rate(bytes_parsed / 1e6));
+  fprintf(file, "  \"elo_rejected\": %llu,\n",
+          (unsigned long long)elo_rejected);
+  fprintf(file, "  \"ply_limited\": %llu,\n", (unsigned long long)ply_limited);
+  fprintf(file, "  \"san_errors\": %llu,\n", (unsigned long long)san_errors);
+  fprintf(file, "  \"unique_games\": %llu,\n",
+          (unsigned long long)unique_games);
+  fprintf(file, "  \"duplicate_games\": %llu,\n",
+          (unsigned long long)duplicate_games);
+  fprintf(file, "  \"entries_before_reduce\": %llu,\n",
+          (unsigned long long)(plies + entries_read));
+  fprintf(file, "  \"entries_after_reduce\": %llu,\n",
+          (unsigned long long)book_entries);
+  fprintf(file, "  \"stages\": {");
+  for (size_t i = 0; i < stages.size(); i++) {
+    fprintf(file, "%s\n    \"%s\": %.3f", i > 0 ? "," : "",
+            stages[i].first.c_str(), stages[i].second);
+  }
+  fprintf(file, "%s},\n", stages.empty() ? "" : "\n  ");
+  fprintf(file, "  \"queues\": {");
+  for (size_t i = 0; i < queues.size(); i++) {
+    auto &[name, stats] = queues[i];
+    fprintf(file,
+            "%s\n    \"%s\": {\"capacity\": %zu, \"pushes\": %llu, "
+            "\"mean_depth\": %.2f, \"max_depth\": %zu, "
+            "\"push_stall_seconds\": %.3f, \"pop_stall_seconds\": %.3f}",
+            i > 0 ? "," : "", name.c_str(), stats.capacity,
+            (unsigned long long)stats.pushes, stats.mean_depth,
+            stats.max_depth, stats.push_stall_seconds,
+            stats.pop_stall_seconds);
+  }
+  fprintf(file, "%s}\n}\n", queues.empty() ? "" : "\n  ");
+
+  if (fclose(file) != 0) {
+    LOG_ERROR("could not write file %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+StageTimer::StageTimer(Metrics &metrics, const string &stage)
+    : metrics(metrics), stage(stage), start(chrono::steady_clock::now()) {}
+
+StageTimer::~StageTimer() { stop(); }
+
+double StageTimer::stop() {
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  if (!stopped) {
+    metrics.add_stage(stage, elapsed.count());
+    stopped = true;
+  }
+  return elapsed.count();
+}
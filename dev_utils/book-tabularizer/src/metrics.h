@@ -0,0 +1,113 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "bounded_queue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// What a builder counts while parsing, before it's added to `Metrics`.
+struct ParseCounters {
+  uint64_t games = 0;
+  // Plies replayed. Each adds one entry to the book before it's reduced.
+  uint64_t plies = 0;
+  uint64_t elo_rejected = 0;
+  // Games that reached the ply limit, the rest of which was skipped.
+  uint64_t ply_limited = 0;
+  uint64_t san_errors = 0;
+  uint64_t unique_games = 0;
+  uint64_t duplicate_games = 0;
+};
+
+/*
+ * Counters and stage timings of a run. Builders add their counters every so
+ * often from any thread, so that the progress lines are up to date. Stages
+ * are timed on the main thread only.
+ */
+class Metrics {
+public:
+  Metrics();
+
+  Metrics(const Metrics &) = delete;
+
+  Metrics &operator=(const Metrics &) = delete;
+
+  ~Metrics();
+
+  void add(const struct ParseCounters &counters);
+
+  atomic<uint64_t> games = 0;
+  atomic<uint64_t> plies = 0;
+  atomic<uint64_t> elo_rejected = 0;
+  atomic<uint64_t> ply_limited = 0;
+  atomic<uint64_t> san_errors = 0;
+  atomic<uint64_t> unique_games = 0;
+  atomic<uint64_t> duplicate_games = 0;
+  // Bytes of PGN parsed, after decompression.
+  atomic<uint64_t> bytes_parsed = 0;
+  // Entries read from Polyglot files, rather than made from plies.
+  atomic<uint64_t> entries_read = 0;
+  // Entries in the book that came out.
+  atomic<uint64_t> book_entries = 0;
+
+  // Add `seconds` to the wall time of `stage`.
+  void add_stage(const string &stage, double seconds);
+
+  // Record how the queue `name` between two stages was used.
+  void add_queue(const string &name, const struct QueueStats &stats);
+
+  // Log a progress line every `interval` until stopped.
+  void start_progress(chrono::seconds interval);
+
+  void stop_progress();
+
+  // Log what was counted and how long each stage took.
+  void log_summary() const;
+
+  // Write everything as one JSON object, for `command`.
+  bool write_json(const string &path, const string &command) const;
+
+private:
+  // Seconds spent parsing, which the rates are over.
+  double parse_seconds() const;
+
+  chrono::steady_clock::time_point start;
+  // In the order the stages first ran.
+  vector<pair<string, double>> stages;
+  vector<pair<string, struct QueueStats>> queues;
+
+  thread progress;
+  mutex progress_mtx;
+  condition_variable progress_cv;
+  bool stopping = false;
+};
+
+/*
+ * Times a stage from construction until it goes out of scope, or until
+ * `stop` is called.
+ */
+class StageTimer {
+public:
+  StageTimer(Metrics &metrics, const string &stage);
+
+  ~StageTimer();
+
+  // Stop timing. Returns the seconds since the timer started.
+  double stop();
+
+private:
+  Metrics &metrics;
+  string stage;
+  chrono::steady_clock::time_point start;
+  bool stopped = false;
+};
+
+#endif /* _METRICS_H_ */
@@ -1,7 +1,9 @@
 #include "pg_builder.h"
 #include "chess.h"
 #include "polyglot.h"
+#include "san.h"
 #include "tinylogger.h"
+#include <cstring>
 
 /*
  * [reference](http://hgm.nubati.net/book_format.html)
@@ -96,14 +98,21 @@ void PGBuilder::startPgn() {
 
   plies = 0;
   keep_game = true;
-
-  static int last_num_entries_logged = 0;
-  if (entries.size() - last_num_entries_logged > 100000) {
-    LOG_DEBUG("read %d entries so far\n", entries.size());
-    last_num_entries_logged = entries.size();
-  }
+  counters.games++;
 
   board.setFen(constants::STARTPOS);
+  in_cache = memoize;
+  hash = board.hash();
+  pending.clear();
+
+  settling = dedup != Dedup::Off;
+  held_sans.clear();
+  held_ends.clear();
+}
+
+// FNV-1a, a byte at a time.
+static inline uint64_t fnv_add(uint64_t h, uint8_t byte) {
+  return (h ^ byte) * 0x100000001B3ULL;
 }
 
 void PGBuilder::header(std::string_view key, std::string_view value) {
@@ -129,23 +138,202 @@ void PGBuilder::startMoves() {
       (white_elo > elo_cutoff && black_elo > elo_cutoff &&
        // Elo is within range
        abs(white_elo - black_elo) <= max_elo_diff));
+
+  // Let the parser skip straight to the next game.
+  if (!keep_game) {
+    counters.elo_rejected++;
+    skipPgn(true);
+  }
+
+  // The result only matters as far as it weighs the moves.
+  game_key = 0xCBF29CE484222325ULL;
+  game_key = fnv_add(game_key, white_weight_multiplier);
+  game_key = fnv_add(game_key, black_weight_multiplier);
 }
 
 void PGBuilder::move(std::string_view san, std::string_view comment) {
   if (!keep_game || plies > max_plies)
     return;
 
-  Move move = uci::parseSan(board, san);
-  uint64_t hash = board.hash();
-  uint16_t multiplier = board.sideToMove() == Color::WHITE
-                            ? white_weight_multiplier
-                            : black_weight_multiplier;
-  struct BookEntry be = {
-      .key = hash, .move = encode_move(move), .weight = multiplier, .learn = 0};
-  entries.push_back(be);
+  if (settling) {
+    hold_back(san);
+    return;
+  }
+
+  if (!play(san)) {
+    keep_game = false;
+    skipPgn(true);
+    return;
+  }
+
+  // That's all we want from this game, the parser can skip the rest of it.
+  if (plies > max_plies) {
+    counters.ply_limited++;
+    skipPgn(true);
+  }
+}
+
+bool PGBuilder::play(string_view san) {
+  uint64_t packed_san;
+  bool cacheable = memoize && ReplayCache::pack_san(san, packed_san);
+  bool left_cache = false;
+  if (in_cache) {
+    struct ReplayStep step;
+    if (cacheable && replay_cache.lookup(hash, packed_san, step)) {
+      add_entry(hash, step.encoded);
+      pending.push_back(step.move);
+      hash = step.child_hash;
+      plies++;
+      return true;
+    }
+    // Looking up the rest of the game would mostly miss, so stop here.
+    in_cache = false;
+    left_cache = true;
+    catch_up();
+  }
+
+  Move move;
+  SanStatus status = resolve_san(board, san, move);
+  if (status != SanStatus::Ok) {
+    // Keep what we got from the game so far, and drop the rest of it.
+    LOG_WARNING("skipping rest of game at %s move \"%.*s\"\n",
+                san_status_name(status), (int)san.size(), san.data());
+    counters.san_errors++;
+    return false;
+  }
+  uint64_t parent_hash = board.hash();
+  uint16_t encoded = encode_move(move);
+  add_entry(parent_hash, encoded);
 
   board.makeMove(move);
   plies++;
+
+  // Only the move that left the cache is added, so the cache grows along
+  // the openings by a ply each time a game follows one.
+  if (left_cache && cacheable) {
+    replay_cache.insert(parent_hash, packed_san,
+                        {.move = move, .encoded = encoded,
+                         .child_hash = board.hash()});
+  }
+  return true;
+}
+
+void PGBuilder::hold_back(string_view san) {
+  // Check and annotation marks don't make a game any different.
+  while (!san.empty() && strchr("+#!?", san.back()) != nullptr) {
+    san.remove_suffix(1);
+  }
+  for (char c : san) {
+    game_key = fnv_add(game_key, c);
+  }
+  game_key = fnv_add(game_key, ' ');
+
+  // Only moves within the ply limit make it into the book.
+  if (held_ends.size() <= (size_t)max_plies) {
+    held_sans.append(san);
+    held_ends.push_back(held_sans.size());
+  }
+
+  // An opening's key is complete once it reaches the ply limit, and the
+  // parser can skip the rest of the game.
+  if (dedup == Dedup::Openings && held_ends.size() > (size_t)max_plies) {
+    settle();
+    skipPgn(true);
+  }
+}
+
+void PGBuilder::settle() {
+  settling = false;
+  if (!seen_games->insert(game_key)) {
+    counters.duplicate_games++;
+    keep_game = false;
+    return;
+  }
+  counters.unique_games++;
+
+  string_view sans = held_sans;
+  uint32_t start = 0;
+  for (uint32_t end : held_ends) {
+    if (!play(sans.substr(start, end - start))) {
+      keep_game = false;
+      return;
+    }
+    start = end;
+  }
+  if (plies > max_plies) {
+    counters.ply_limited++;
+  }
 }
 
-void PGBuilder::endPgn() {}
+void PGBuilder::add_entry(uint64_t hash, uint16_t move) {
+  counters.plies++;
+  // The game starts from the initial position, so white moves on even plies.
+  uint16_t multiplier =
+      plies % 2 == 0 ? white_weight_multiplier : black_weight_multiplier;
+  struct BookEntry be = {
+      .key = hash, .move = move, .weight = multiplier, .learn = 0};
+  if (aggregate) {
+    table.add(be.key, be.move, be.weight);
+  } else {
+    entries.push_back(be);
+  }
+}
+
+void PGBuilder::catch_up() {
+  for (auto &move : pending) {
+    board.makeMove(move);
+  }
+}
+
+void PGBuilder::endPgn() {
+  // Games that end before the ply limit, or any game when its key is all of
+  // its moves, are only settled now.
+  if (settling && keep_game) {
+    settle();
+  }
+
+  if (metrics && counters.games >= 1024) {
+    flush_counters();
+  }
+
+  // Only between games, so that spilling doesn't interfere with one.
+  maybe_spill();
+}
+
+void PGBuilder::take_entries(vector<struct BookEntry> &batch) {
+  if (aggregate) {
+    for (auto &be : batch) {
+      table.add(be.key, be.move, be.weight);
+    }
+  } else {
+    // A batch is much more than a game, so make room for it first rather
+    // than let the vector grow past its share of the budget.
+    if (spiller && !entries.empty() &&
+        entries.size() + batch.size() > spill_entries) {
+      spiller->spill(entries);
+    }
+    entries.insert(entries.end(), batch.begin(), batch.end());
+  }
+  batch.clear();
+  maybe_spill();
+}
+
+void PGBuilder::maybe_spill() {
+  if (spiller == nullptr) {
+    return;
+  }
+  if (aggregate &&
+      table.memory() >= spill_entries * sizeof(struct BookEntry)) {
+    table.drain(entries);
+  }
+  if (entries.size() >= spill_entries) {
+    spiller->spill(entries);
+  }
+}
+
+void PGBuilder::flush_counters() {
+  if (metrics) {
+    metrics->add(counters);
+  }
+  counters = ParseCounters();
+}
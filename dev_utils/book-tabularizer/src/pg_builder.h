@@ -1,9 +1,17 @@
 #include "chess.h"
+#include "entry_table.h"
+#include "game_set.h"
+#include "metrics.h"
 #include "polyglot.h"
+#include "replay_cache.h"
+#include "spill.h"
 
 using namespace chess;
 using namespace std;
 
+// `move` in polyglot's encoding.
+uint16_t encode_move(Move &move);
+
 class PGBuilder : public pgn::Visitor {
 public:
   vector<struct BookEntry> entries;
@@ -11,6 +19,31 @@ public:
   int max_elo_diff = 10000;
   int max_plies = 20;
 
+  // If set, entries are spilled once there are `spill_entries` of them.
+  RunSpiller *spiller = nullptr;
+  size_t spill_entries = 0;
+
+  // If set, entries are aggregated in `table` as they come in rather than
+  // collected in `entries`.
+  bool aggregate = false;
+  EntryTable table;
+
+  // If set, moves shared with earlier games are taken from `replay_cache`
+  // instead of being replayed on the board.
+  bool memoize = false;
+  ReplayCache replay_cache;
+
+  // If set, games whose key is already in `seen_games` are dropped. Their
+  // moves are held back until the key is complete, so that duplicates are
+  // never replayed.
+  Dedup dedup = Dedup::Off;
+  GameSet *seen_games = nullptr;
+
+  // Counted since they were last added to `metrics`, which happens every so
+  // often between games and on `flush_counters`.
+  struct ParseCounters counters;
+  Metrics *metrics = nullptr;
+
   PGBuilder();
 
   virtual ~PGBuilder();
@@ -25,11 +58,43 @@ public:
 
   void endPgn();
 
+  void flush_counters();
+
+  // Add entries another builder made, spilling if need be as if a game had
+  // just ended. `batch` is left empty.
+  void take_entries(vector<struct BookEntry> &batch);
+
   void write(ostream &strm);
 
 private:
+  // Replay `san` on the board and add its entry. False if it isn't a legal
+  // move, in which case the rest of the game is dropped.
+  bool play(string_view san);
+
+  // Add `san` to the game's key, holding it back if it's within the ply
+  // limit.
+  void hold_back(string_view san);
+
+  // Settle whether the game is a duplicate and, if not, replay the moves
+  // held back.
+  void settle();
+
+  void add_entry(uint64_t hash, uint16_t move);
+
+  // Bring `board` up to date with the moves taken from the cache.
+  void catch_up();
+
+  // Spill what was collected, if it's over the share of the budget.
+  void maybe_spill();
+
   Board board;
 
+  // While the game is still in the cache, `board` is left behind at the
+  // start position and `hash` is the position the game has reached, with
+  // `pending` the moves made since.
+  bool in_cache = false;
+  uint64_t hash = 0;
+  vector<Move> pending;
 
   int black_elo = -1;
   int white_elo = -1;
@@ -41,4 +106,11 @@ private:
 
   int plies = 0;
   bool keep_game = true;
+
+  // While `settling`, moves are held back in `held_sans`, each of them
+  // ending at its offset in `held_ends`, and `game_key` is the hash so far.
+  bool settling = false;
+  uint64_t game_key = 0;
+  string held_sans;
+  vector<uint32_t> held_ends;
 };
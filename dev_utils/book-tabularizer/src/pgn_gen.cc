@@ -0,0 +1,403 @@
+#include "pgn_gen.h"
+#include "chess.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace chess;
+
+// The high 64 bits of a * b, from 32 bit halves, since 128 bit integers
+// aren't standard.
+static uint64_t mul_high(uint64_t a, uint64_t b) {
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t lo_lo = a_lo * b_lo;
+  uint64_t hi_lo = a_hi * b_lo;
+  uint64_t lo_hi = a_lo * b_hi;
+  uint64_t hi_hi = a_hi * b_hi;
+  uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+  return hi_hi + (hi_lo >> 32) + (cross >> 32);
+}
+
+// splitmix64, which is all the randomness a game needs and cheap to seed per
+// game.
+class GameRng {
+public:
+  GameRng(uint64_t seed) : state(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // In [0, n). Multiplying rather than dividing is a lot cheaper, and just
+  // as uniform for the small `n` we need.
+  uint64_t below(uint64_t n) { return mul_high(next(), n); }
+
+  // In [lo, hi].
+  int between(int lo, int hi) { return lo + below(hi - lo + 1); }
+
+  // True `per_mille` times in a thousand.
+  bool chance(int per_mille) { return (int)below(1000) < per_mille; }
+
+private:
+  uint64_t state;
+};
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+  GameRng rng(a ^ (b * 0xD6E8FEB86659FD93ULL));
+  return rng.next();
+}
+
+static const char *EVENTS[] = {"Synthetic Open", "Bench Masters",
+                               "Rapid Invitational", "Club Championship",
+                               "Online Blitz Arena"};
+static const char *SITES[] = {"Berlin GER", "Toronto CAN", "Chennai IND",
+                              "Reykjavik ISL", "Lima PER", "Online"};
+static const char *TIME_CONTROLS[] = {"180+2", "300", "600+5", "5400+30",
+                                      "60"};
+static const int NAGS[] = {1, 2, 3, 4, 5, 6, 10, 13, 14, 15, 16, 17, 18, 19};
+
+static void append_square(string &out, Square sq) {
+  out += (char)('a' + (sq.index() & 7));
+  out += (char)('1' + (sq.index() >> 3));
+}
+
+/*
+ * Append the SAN of `move`, one of the legal `moves` on `board`, leaving off
+ * the check mark. Only that needs the position after the move, whose moves
+ * the caller generates anyway.
+ */
+static void append_san(string &out, const Board &board, Move move,
+                       const Movelist &moves) {
+  if (move.typeOf() == Move::CASTLING) {
+    out += move.to().index() > move.from().index() ? "O-O" : "O-O-O";
+    return;
+  }
+
+  PieceType type = board.at(move.from()).type();
+  bool capture = board.at(move.to()) != Piece::NONE ||
+                 move.typeOf() == Move::ENPASSANT;
+
+  if (type == PieceType::PAWN) {
+    if (capture) {
+      out += (char)('a' + (move.from().index() & 7));
+    }
+  } else {
+    out += "PNBRQK"[(int)type];
+
+    // Disambiguate by file if that does it, else by rank, else by both.
+    bool ambiguous = false, same_file = false, same_rank = false;
+    for (const auto &other : moves) {
+      if (other == move || other.to() != move.to() ||
+          board.at(other.from()).type() != type) {
+        continue;
+      }
+      ambiguous = true;
+      same_file |= (other.from().index() & 7) == (move.from().index() & 7);
+      same_rank |= (other.from().index() >> 3) == (move.from().index() >> 3);
+    }
+    if (ambiguous) {
+      if (!same_file) {
+        out += (char)('a' + (move.from().index() & 7));
+      } else if (!same_rank) {
+        out += (char)('1' + (move.from().index() >> 3));
+      } else {
+        append_square(out, move.from());
+      }
+    }
+  }
+
+  if (capture) {
+    out += 'x';
+  }
+  append_square(out, move.to());
+  if (move.typeOf() == Move::PROMOTION) {
+    out += '=';
+    out += "PNBRQK"[(int)move.promotionType()];
+  }
+}
+
+/*
+ * Pick a move. Within the opening, moves are ranked by a hash of the
+ * position and the corpus seed, and the best ranked are far more likely, so
+ * games keep to a shared tree. The first move is the exception: it's picked
+ * evenly, as otherwise the few moves at the root would take so many games
+ * that their weights overflow in large books. After the opening, captures
+ * and promotions are favoured, as they are in real games.
+ */
+static Move choose_move(const Board &board, const Movelist &moves, int ply,
+                        const struct PgnGenOptions &opts, GameRng &rng) {
+  if (ply > 0 && ply < opts.opening_plies) {
+    pair<uint64_t, int> ranked[256];
+    for (int i = 0; i < moves.size(); i++) {
+      ranked[i] = {mix(board.hash() ^ opts.seed, moves[i].move()), i};
+    }
+    // Each rank half as likely as the one before.
+    int rank = 0;
+    while (rank + 1 < moves.size() && rng.chance(500)) {
+      rank++;
+    }
+    nth_element(ranked, ranked + rank, ranked + moves.size());
+    return moves[ranked[rank].second];
+  }
+
+  int weights[256];
+  int total = 0;
+  for (int i = 0; i < moves.size(); i++) {
+    int weight = 1;
+    if (moves[i].typeOf() == Move::PROMOTION) {
+      weight = moves[i].promotionType() == PieceType::QUEEN ? 8 : 1;
+    } else if (board.at(moves[i].to()) != Piece::NONE) {
+      weight = 4;
+    }
+    weights[i] = weight;
+    total += weight;
+  }
+  int pick = rng.below(total);
+  for (int i = 0; i < moves.size(); i++) {
+    pick -= weights[i];
+    if (pick < 0) {
+      return moves[i];
+    }
+  }
+  return moves[moves.size() - 1];
+}
+
+// Appends tokens to movetext, wrapping lines as PGN export does.
+class MoveText {
+public:
+  MoveText(string &out) : out(out) {}
+
+  void token(string_view text) {
+    if (line_length > 0 && line_length + 1 + text.size() > 79) {
+      out += '\n';
+      line_length = 0;
+    } else if (line_length > 0) {
+      out += ' ';
+      line_length++;
+    }
+    out += text;
+    line_length += text.size();
+  }
+
+  /*
+   * A comment, NAG or variation, which stays on the line of the move it
+   * belongs to. Parsers that expect them right after the move, like ours,
+   * would take one at the start of a line for a move.
+   */
+  void appendix(string_view text) {
+    out += ' ';
+    out += text;
+    line_length += 1 + text.size();
+  }
+
+  // The move number, if it's needed before the move of `ply`.
+  void number(int ply, bool after_break) {
+    if (ply % 2 == 0) {
+      token(to_string(ply / 2 + 1) + ".");
+    } else if (after_break) {
+      token(to_string(ply / 2 + 1) + "...");
+    }
+  }
+
+private:
+  string &out;
+  size_t line_length = 0;
+};
+
+static string make_comment(GameRng &rng) {
+  char buf[64];
+  switch (rng.below(4)) {
+  case 0:
+    snprintf(buf, sizeof(buf), "{[%%eval %.2f]}",
+             ((int)rng.below(601) - 300) / 100.0);
+    break;
+  case 1:
+    snprintf(buf, sizeof(buf), "{[%%clk 0:%02d:%02d]}", (int)rng.below(60),
+             (int)rng.below(60));
+    break;
+  case 2:
+    snprintf(buf, sizeof(buf), "{Only move}");
+    break;
+  default:
+    snprintf(buf, sizeof(buf), "{A novelty, %d games in the database}",
+             (int)rng.below(100));
+    break;
+  }
+  return buf;
+}
+
+// A short line of play from `board` starting with `first`, as a variation.
+static string make_variation(Board board, Move first, int ply,
+                             const struct PgnGenOptions &opts, GameRng &rng) {
+  string variation;
+  MoveText text(variation);
+  Movelist moves;
+  movegen::legalmoves(moves, board);
+  Move move = first;
+  int length = rng.between(1, 4);
+  for (int i = 0; i < length; i++, ply++) {
+    text.number(ply, i == 0);
+    string san;
+    append_san(san, board, move, moves);
+    board.makeMove(move);
+    movegen::legalmoves(moves, board);
+    if (board.inCheck()) {
+      san += moves.empty() ? '#' : '+';
+    }
+    text.token(san);
+    if (moves.empty()) {
+      break;
+    }
+    move = choose_move(board, moves, ply + 1, opts, rng);
+  }
+  return "(" + variation + ")";
+}
+
+void generate_game(const struct PgnGenOptions &opts, size_t index,
+                   string &out) {
+  GameRng rng(mix(opts.seed, index));
+
+  // The moves come first, since the result and ply count go in the headers.
+  string movetext;
+  MoveText text(movetext);
+  Board board;
+  Movelist moves;
+  movegen::legalmoves(moves, board);
+  int length = rng.between(opts.min_plies, opts.max_plies);
+  int ply = 0;
+  bool after_break = false;
+  for (; ply < length && !moves.empty(); ply++) {
+    Move move = choose_move(board, moves, ply, opts, rng);
+
+    // Variations are alternatives to the move, so they're made up now.
+    string variation;
+    if (ply >= opts.opening_plies && moves.size() > 1 &&
+        rng.chance(opts.variation_rate)) {
+      Move alternative = move;
+      while (alternative == move) {
+        alternative = moves[rng.below(moves.size())];
+      }
+      variation = make_variation(board, alternative, ply, opts, rng);
+    }
+
+    string san;
+    append_san(san, board, move, moves);
+    board.makeMove(move);
+    movegen::legalmoves(moves, board);
+    if (board.inCheck()) {
+      san += moves.empty() ? '#' : '+';
+    }
+
+    text.number(ply, after_break);
+    text.token(san);
+    after_break = false;
+    if (rng.chance(opts.nag_rate)) {
+      text.appendix("$" + to_string(NAGS[rng.below(size(NAGS))]));
+    }
+    if (rng.chance(opts.comment_rate)) {
+      text.appendix(make_comment(rng));
+      after_break = true;
+    }
+    if (!variation.empty()) {
+      text.appendix(variation);
+      after_break = true;
+    }
+  }
+
+  // Elo are roughly normal around 2200, and opponents usually close.
+  int white_elo = 1600 + rng.below(301) + rng.below(301) + rng.below(301) +
+                  rng.below(301);
+  int black_elo = white_elo + rng.between(-250, 250);
+  bool has_elo = rng.chance(900);
+
+  const char *result;
+  if (moves.empty()) {
+    // Checkmate or stalemate.
+    result = !board.inCheck() ? "1/2-1/2" : ply % 2 == 1 ? "1-0" : "0-1";
+  } else {
+    // The stronger side wins more often.
+    int white_chance = 350 + (white_elo - black_elo);
+    int draw_chance = 300;
+    int roll = rng.below(1000);
+    result = roll < white_chance               ? "1-0"
+             : roll < white_chance + draw_chance ? "1/2-1/2"
+                                                 : "0-1";
+  }
+  text.token(result);
+
+  char buf[128];
+  out += "[Event \"";
+  out += EVENTS[rng.below(size(EVENTS))];
+  out += "\"]\n[Site \"";
+  out += SITES[rng.below(size(SITES))];
+  snprintf(buf, sizeof(buf), "\"]\n[Date \"%d.%02d.%02d\"]\n",
+           (int)rng.between(1990, 2025), (int)rng.between(1, 12),
+           (int)rng.between(1, 28));
+  out += buf;
+  snprintf(buf, sizeof(buf), "[Round \"%d\"]\n", (int)rng.between(1, 13));
+  out += buf;
+  snprintf(buf, sizeof(buf),
+           "[White \"Player %05d\"]\n[Black \"Player %05d\"]\n",
+           (int)rng.below(100000), (int)rng.below(100000));
+  out += buf;
+  out += "[Result \"";
+  out += result;
+  out += "\"]\n";
+  if (has_elo) {
+    snprintf(buf, sizeof(buf), "[WhiteElo \"%d\"]\n[BlackElo \"%d\"]\n",
+             white_elo, black_elo);
+    out += buf;
+  }
+  snprintf(buf, sizeof(buf), "[ECO \"%c%02d\"]\n", (char)('A' + rng.below(5)),
+           (int)rng.below(100));
+  out += buf;
+  out += "[TimeControl \"";
+  out += TIME_CONTROLS[rng.below(size(TIME_CONTROLS))];
+  snprintf(buf, sizeof(buf), "\"]\n[PlyCount \"%d\"]\n\n", ply);
+  out += buf;
+  out += movetext;
+  out += "\n\n";
+}
+
+// Games per batch. Large enough that starting the threads doesn't matter.
+static const size_t BATCH_GAMES = 4096;
+
+bool generate_pgn(ostream &strm, const struct PgnGenOptions &opts,
+                  int threads) {
+  threads = max(threads, 1);
+  vector<string> batches(threads);
+  for (size_t first = 0; first < opts.games;
+       first += BATCH_GAMES * threads) {
+    // Each thread makes one batch, and they're written out in order.
+    auto generate = [&](int t) {
+      auto &batch = batches[t];
+      batch.clear();
+      size_t begin = first + t * BATCH_GAMES;
+      size_t end = min(begin + BATCH_GAMES, opts.games);
+      for (size_t i = begin; i < end; i++) {
+        generate_game(opts, i, batch);
+      }
+    };
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) {
+      workers.emplace_back(generate, t);
+    }
+    generate(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+
+    for (auto &batch : batches) {
+      strm.write(batch.data(), batch.size());
+    }
+    if (!strm) {
+      return false;
+    }
+  }
+  return true;
+}
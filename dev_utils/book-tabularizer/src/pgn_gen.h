@@ -0,0 +1,41 @@
+#ifndef _PGN_GEN_H_
+#define _PGN_GEN_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+struct PgnGenOptions {
+  uint64_t seed;
+  size_t games;
+  // Games that don't end by themselves are cut off at a random length in
+  // this range.
+  int min_plies;
+  int max_plies;
+  // The first plies of every game follow a random but fixed opening tree, so
+  // that games share openings like real ones do.
+  int opening_plies;
+  // Per mille of moves that get a comment, a NAG or a variation.
+  int comment_rate;
+  int nag_rate;
+  int variation_rate;
+};
+
+/*
+ * Append game number `index` of the corpus `opts` describes to `out`: a
+ * random legal game with a full set of headers. It only depends on `opts`
+ * and `index`, so games can be generated in any order, on any thread.
+ */
+void generate_game(const struct PgnGenOptions &opts, size_t index,
+                   string &out);
+
+/*
+ * Write the whole corpus to `strm`, generating it on `threads` threads. The
+ * output is the same for any number of threads.
+ */
+bool generate_pgn(ostream &strm, const struct PgnGenOptions &opts,
+                  int threads);
+
+#endif /* _PGN_GEN_H_ */
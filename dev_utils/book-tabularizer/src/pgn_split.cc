@@ -0,0 +1,31 @@
+#include "pgn_split.h"
+
+vector<string_view> split_pgn(string_view pgn, size_t parts) {
+  vector<string_view> ranges;
+  if (parts <= 1) {
+    ranges.push_back(pgn);
+    return ranges;
+  }
+
+  size_t start = 0;
+  for (size_t i = 1; i < parts && start < pgn.size(); i++) {
+    // Aim for an even split, but don't go back into the previous range.
+    size_t target = max(pgn.size() / parts * i, start);
+
+    // The newline keeps us from matching "[Event" inside a comment or header
+    // value, at least in any sanely formatted PGN.
+    size_t boundary = pgn.find("\n[Event ", target);
+    if (boundary == string_view::npos) {
+      break;
+    }
+    boundary++;
+
+    if (boundary > start) {
+      ranges.push_back(pgn.substr(start, boundary - start));
+      start = boundary;
+    }
+  }
+  ranges.push_back(pgn.substr(start));
+
+  return ranges;
+}
@@ -0,0 +1,17 @@
+#ifndef _PGN_SPLIT_H_
+#define _PGN_SPLIT_H_
+
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Split a buffer of PGNs into at most `parts` roughly equal ranges. Every
+ * range but the first starts at an `[Event` tag at the beginning of a line,
+ * so each range can be parsed on its own. Concatenating the ranges gives back
+ * `pgn`.
+ */
+vector<string_view> split_pgn(string_view pgn, size_t parts);
+
+#endif /* _PGN_SPLIT_H_ */
@@ -0,0 +1,333 @@
+#include "piped_input.h"
+#include "tinylogger.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Large enough that the reader rarely waits on a chunk swap, small enough
+// that the queue doesn't hold on to much memory.
+static const size_t CHUNK_SIZE = 1 << 20;
+static const size_t QUEUE_DEPTH = 4;
+
+static Compression sniff_compression(const char *buf, size_t n) {
+  const unsigned char *magic = (const unsigned char *)buf;
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return Compression::Gzip;
+  }
+  if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd) {
+    return Compression::Zstd;
+  }
+  return Compression::None;
+}
+
+Compression detect_compression(const string &path) {
+  if (path == "-") {
+    return Compression::None;
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Compression::None;
+  }
+  char magic[4];
+  ssize_t n = read(fd, magic, sizeof(magic));
+  close(fd);
+
+  return n < 0 ? Compression::None : sniff_compression(magic, n);
+}
+
+PipedInput::PipedInput() {}
+
+PipedInput::~PipedInput() {
+  {
+    lock_guard<mutex> lk(mtx);
+    closing = true;
+  }
+  cv.notify_all();
+
+  if (worker.joinable()) {
+    worker.join();
+  }
+  if (fd > STDIN_FILENO) {
+    close(fd);
+  }
+}
+
+bool PipedInput::open(const string &path) {
+  this->path = path;
+  if (path == "-") {
+    fd = STDIN_FILENO;
+  } else {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG_ERROR("could not open file %s: %s\n", path.c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  worker = thread(&PipedInput::run, this);
+  return true;
+}
+
+bool PipedInput::failed() const { return error; }
+
+size_t PipedInput::bytes_out() const { return out_bytes; }
+
+size_t PipedInput::bytes_in() const { return in_bytes; }
+
+PipedInput::int_type PipedInput::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+
+  unique_lock<mutex> lk(mtx);
+  // Give the chunk we're done with back to the worker to refill.
+  if (current.capacity() > 0) {
+    spare.push_back(std::move(current));
+    current = vector<char>();
+  }
+
+  cv.wait(lk, [&] { return !filled.empty() || done; });
+  if (filled.empty()) {
+    setg(nullptr, nullptr, nullptr);
+    return traits_type::eof();
+  }
+
+  current = std::move(filled.front());
+  filled.pop_front();
+  lk.unlock();
+  cv.notify_all();
+
+  out_bytes += current.size();
+  setg(current.data(), current.data(), current.data() + current.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+vector<char> PipedInput::take_chunk() {
+  vector<char> chunk;
+  {
+    lock_guard<mutex> lk(mtx);
+    if (!spare.empty()) {
+      chunk = std::move(spare.back());
+      spare.pop_back();
+    }
+  }
+  chunk.resize(CHUNK_SIZE);
+  return chunk;
+}
+
+bool PipedInput::push(vector<char> &chunk) {
+  {
+    unique_lock<mutex> lk(mtx);
+    cv.wait(lk, [&] { return filled.size() < QUEUE_DEPTH || closing; });
+    if (closing) {
+      return false;
+    }
+    filled.push_back(std::move(chunk));
+  }
+  cv.notify_all();
+
+  chunk = take_chunk();
+  return true;
+}
+
+bool PipedInput::read_raw(vector<char> &chunk) {
+  chunk.resize(CHUNK_SIZE);
+  while (true) {
+    ssize_t n = read(fd, chunk.data(), chunk.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("could not read %s: %s\n", path.c_str(), strerror(errno));
+      chunk.clear();
+      return false;
+    }
+
+    chunk.resize(n);
+    in_bytes += n;
+    return true;
+  }
+}
+
+void PipedInput::run() {
+  vector<char> in = take_chunk();
+  bool ok = read_raw(in);
+
+  if (ok) {
+    switch (sniff_compression(in.data(), in.size())) {
+    case Compression::None:
+      ok = pump_plain(in);
+      break;
+    case Compression::Gzip:
+      ok = pump_gzip(in);
+      break;
+    case Compression::Zstd:
+      ok = pump_zstd(in);
+      break;
+    }
+  }
+
+  {
+    lock_guard<mutex> lk(mtx);
+    error = !ok;
+    done = true;
+  }
+  cv.notify_all();
+}
+
+bool PipedInput::pump_plain(vector<char> &in) {
+  // Nothing to decode, hand the read chunks over as they are.
+  while (!in.empty()) {
+    if (!push(in) || !read_raw(in)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PipedInput::pump_gzip(vector<char> &in) {
+#ifdef HAVE_ZLIB
+  z_stream zs = {};
+  // 32 lets zlib detect the gzip header on its own.
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    LOG_ERROR("could not initialize zlib\n");
+    return false;
+  }
+
+  vector<char> out = take_chunk();
+  zs.next_out = (Bytef *)out.data();
+  zs.avail_out = out.size();
+  zs.next_in = (Bytef *)in.data();
+  zs.avail_in = in.size();
+
+  bool ok = true;
+  bool in_member = true;
+  // zlib may still hold decoded data after filling the output, so drain it
+  // before reading on.
+  bool out_full = false;
+  while (ok) {
+    if (zs.avail_in == 0 && !out_full) {
+      if (!read_raw(in)) {
+        ok = false;
+        break;
+      }
+      if (in.empty()) {
+        break;
+      }
+      zs.next_in = (Bytef *)in.data();
+      zs.avail_in = in.size();
+    }
+
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // gzip files may be several members concatenated, e.g. from pigz or
+      // `cat a.gz b.gz`.
+      inflateReset(&zs);
+      in_member = false;
+    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+      in_member = true;
+    } else {
+      LOG_ERROR("could not decompress %s: %s\n", path.c_str(),
+                zs.msg ? zs.msg : "zlib error");
+      ok = false;
+    }
+
+    out_full = zs.avail_out == 0;
+    if (out_full) {
+      ok = ok && push(out);
+      zs.next_out = (Bytef *)out.data();
+      zs.avail_out = out.size();
+    }
+  }
+
+  if (ok && in_member) {
+    LOG_WARNING("%s ends in the middle of a gzip member\n", path.c_str());
+  }
+  out.resize(out.size() - zs.avail_out);
+  if (ok && !out.empty()) {
+    ok = push(out);
+  }
+
+  inflateEnd(&zs);
+  return ok;
+#else
+  (void)in;
+  LOG_ERROR("%s is gzip compressed, but we were built without zlib\n",
+            path.c_str());
+  return false;
+#endif
+}
+
+bool PipedInput::pump_zstd(vector<char> &in) {
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zds = ZSTD_createDStream();
+  if (zds == nullptr) {
+    LOG_ERROR("could not initialize zstd\n");
+    return false;
+  }
+  ZSTD_initDStream(zds);
+
+  vector<char> out = take_chunk();
+  ZSTD_outBuffer zout = {out.data(), out.size(), 0};
+  ZSTD_inBuffer zin = {in.data(), in.size(), 0};
+
+  bool ok = true;
+  // 0 once a frame is fully decoded, a hint of the remaining input otherwise.
+  size_t ret = 0;
+  // zstd may still hold decoded data after filling the output, so drain it
+  // before reading on.
+  bool out_full = false;
+  while (ok) {
+    if (zin.pos == zin.size && !out_full) {
+      if (!read_raw(in)) {
+        ok = false;
+        break;
+      }
+      if (in.empty()) {
+        break;
+      }
+      zin = {in.data(), in.size(), 0};
+    }
+
+    // Multiple frames are decoded back to back without any extra work.
+    ret = ZSTD_decompressStream(zds, &zout, &zin);
+    if (ZSTD_isError(ret)) {
+      LOG_ERROR("could not decompress %s: %s\n", path.c_str(),
+                ZSTD_getErrorName(ret));
+      ok = false;
+    }
+
+    out_full = zout.pos == zout.size;
+    if (out_full) {
+      ok = ok && push(out);
+      zout = {out.data(), out.size(), 0};
+    }
+  }
+
+  if (ok && ret != 0) {
+    LOG_WARNING("%s ends in the middle of a zstd frame\n", path.c_str());
+  }
+  out.resize(zout.pos);
+  if (ok && !out.empty()) {
+    ok = push(out);
+  }
+
+  ZSTD_freeDStream(zds);
+  return ok;
+#else
+  (void)in;
+  LOG_ERROR("%s is zstd compressed, but we were built without zstd\n",
+            path.c_str());
+  return false;
+#endif
+}
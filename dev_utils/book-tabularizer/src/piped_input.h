@@ -0,0 +1,92 @@
+#ifndef _PIPED_INPUT_H_
+#define _PIPED_INPUT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum class Compression { None, Gzip, Zstd };
+
+/*
+ * Guess the compression of a file from its magic bytes. "-" is stdin, which
+ * can't be peeked at without consuming it, so it's reported as unknown
+ * (None) and sniffed by PipedInput itself.
+ */
+Compression detect_compression(const string &path);
+
+/*
+ * A stream buffer over a file or stdin ("-") that may be gzip or zstd
+ * compressed. Reading and decompressing run on their own thread, which hands
+ * decompressed chunks to the reader through a small bounded queue, so the
+ * consumer of the stream only ever waits on a memcpy-free chunk swap.
+ */
+class PipedInput : public streambuf {
+public:
+  PipedInput();
+
+  PipedInput(const PipedInput &) = delete;
+
+  PipedInput &operator=(const PipedInput &) = delete;
+
+  ~PipedInput();
+
+  bool open(const string &path);
+
+  // Whether reading or decompressing failed. Only meaningful once the stream
+  // hit EOF.
+  bool failed() const;
+
+  // Bytes handed out to the reader, i.e. after decompression.
+  size_t bytes_out() const;
+
+  // Bytes read from the file, i.e. before decompression.
+  size_t bytes_in() const;
+
+protected:
+  int_type underflow() override;
+
+private:
+  void run();
+
+  // Hand a filled chunk to the reader, blocking while the queue is full.
+  // Returns false if the reader went away.
+  bool push(vector<char> &chunk);
+
+  // A recycled chunk if there is one, a new one otherwise.
+  vector<char> take_chunk();
+
+  bool read_raw(vector<char> &chunk);
+
+  bool pump_plain(vector<char> &in);
+
+  bool pump_gzip(vector<char> &in);
+
+  bool pump_zstd(vector<char> &in);
+
+  int fd = -1;
+  string path;
+  thread worker;
+
+  mutex mtx;
+  condition_variable cv;
+  deque<vector<char>> filled;
+  deque<vector<char>> spare;
+  bool done = false;
+  bool closing = false;
+  atomic<bool> error = false;
+
+  // The chunk the get area currently points into.
+  vector<char> current;
+
+  atomic<size_t> in_bytes = 0;
+  size_t out_bytes = 0;
+};
+
+#endif /* _PIPED_INPUT_H_ */
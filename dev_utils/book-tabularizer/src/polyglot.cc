@@ -1,7 +1,14 @@
 #include "polyglot.h"
+#include "entry_codec.h"
 #include "tinylogger.h"
 #include "util.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
+#include <sys/mman.h>
+#include <unistd.h>
 
 bool BookEntry::operator<(const BookEntry &be) const {
   if (key != be.key)
@@ -11,81 +18,277 @@ bool BookEntry::operator<(const BookEntry &be) const {
 }
 
 vector<struct BookEntry> read_pg_file(ifstream &strm) {
-  // Look for 16 bytes of 0
+  read_pg_header(strm);
+
+  vector<struct BookEntry> entries;
+  while (read_pg_entries(strm, entries, SIZE_MAX) > 0) {
+  }
+
+  return entries;
+}
+
+// Entries are read from and written to streams this many at a time.
+static const size_t READ_CHUNK_ENTRIES = 4096;
+
+// Whether `block`, the first 16 bytes of a file, starts our header.
+static bool is_pg_header(const char *block) {
+  return *(const uint64_t *)block == 0 && memcmp(block + 8, "@PG@", 4) == 0;
+}
+
+static bool is_zero_block(const char *block) {
+  return *(const uint64_t *)block == 0 && *(const uint64_t *)(block + 8) == 0;
+}
+
+// Back `bytes` at `addr` with huge pages, if the kernel lets us. Filling
+// fresh memory otherwise takes a page fault every 4 KiB, which costs more
+// than decoding into it.
+static void advise_huge_pages(void *addr, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+  const uintptr_t page = 4096;
+  uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)addr + bytes) & ~(page - 1);
+  if (end > start) {
+    // Only a hint, and small buffers won't get any anyway.
+    madvise((void *)start, end - start, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+void read_pg_header(ifstream &strm) {
+  auto start = strm.tellg();
   char buf[16];
-  while (1) {
-    strm.read(buf, 16);
-    if (*(uint64_t *)buf == 0 && *(uint64_t *)(buf + 8) == 0) {
-      break;
+  if (!strm.read(buf, 16) || !is_pg_header(buf)) {
+    // No header, the entries start right away.
+    strm.clear();
+    strm.seekg(start);
+    return;
+  }
+  // The header ends with 16 bytes of 0
+  while (strm.read(buf, 16) && !is_zero_block(buf)) {
+  }
+}
+
+size_t read_pg_entries(ifstream &strm, vector<struct BookEntry> &entries,
+                       size_t max_entries) {
+  size_t num_read = 0;
+  while (num_read < max_entries && strm) {
+    // Read straight into `entries` and decode them in place.
+    size_t want = min(max_entries - num_read, READ_CHUNK_ENTRIES);
+    size_t size = entries.size();
+    entries.resize(size + want);
+    strm.read((char *)(entries.data() + size),
+              want * sizeof(struct BookEntry));
+    // A partial entry at the end of the file is dropped.
+    size_t got = strm.gcount() / sizeof(struct BookEntry);
+    entries.resize(size + got);
+    decode_entries((const char *)(entries.data() + size), got,
+                   entries.data() + size);
+    num_read += got;
+  }
+
+  return num_read;
+}
+
+bool PolyglotFile::open(const string &path, int advice) {
+  close();
+  if (!file.open(path, advice)) {
+    return false;
+  }
+
+  string_view view = file.view();
+  size_t start = 0;
+  header = view.size() >= 16 && is_pg_header(view.data());
+  if (header) {
+    // The header ends with 16 bytes of 0, and the entries follow.
+    start = view.size();
+    for (size_t offset = 16; offset + 16 <= view.size(); offset += 16) {
+      if (is_zero_block(view.data() + offset)) {
+        start = offset + 16;
+        break;
+      }
+    }
+    if (start == view.size()) {
+      LOG_WARNING("header of %s doesn't end, taking it for empty\n",
+                  path.c_str());
     }
   }
 
-  vector<struct BookEntry> entries;
+  size_t bytes = view.size() - start;
+  if (bytes % sizeof(struct BookEntry) != 0) {
+    LOG_WARNING("%s ends in a partial entry, ignoring it\n", path.c_str());
+  }
+  data = view.data() + start;
+  num_entries = bytes / sizeof(struct BookEntry);
+  return true;
+}
+
+void PolyglotFile::close() {
+  file.close();
+  data = nullptr;
+  num_entries = 0;
+  header = false;
+}
+
+bool PolyglotFile::has_header() const { return header; }
+
+size_t PolyglotFile::size() const { return num_entries; }
+
+struct BookEntry PolyglotFile::entry(size_t i) const {
   struct BookEntry be;
-  while (1) {
-    strm.read((char *)&be, sizeof(struct BookEntry));
-    be.key = swap64(be.key);
-    be.move = swap16(be.move);
-    be.weight = swap16(be.weight);
-    be.learn = swap32(be.learn);
-    if (strm.eof()) {
-      break;
-    } else {
-      entries.push_back(be);
-    }
+  decode_entries(data + i * sizeof(struct BookEntry), 1, &be);
+  return be;
+}
+
+void PolyglotFile::decode(size_t start, size_t count,
+                          struct BookEntry *out) const {
+  decode_entries(data + start * sizeof(struct BookEntry), count, out);
+}
+
+void PolyglotFile::release(size_t start, size_t count) const {
+  const uintptr_t page = 4096;
+  uintptr_t from = (uintptr_t)(data + start * sizeof(struct BookEntry));
+  uintptr_t to = from + count * sizeof(struct BookEntry);
+  from &= ~(page - 1);
+  to &= ~(page - 1);
+  if (to > from) {
+    madvise((void *)from, to - from, MADV_DONTNEED);
   }
+}
 
-  return entries;
+void PolyglotFile::decode_all(vector<struct BookEntry> &entries) const {
+  size_t size = entries.size();
+  if (entries.capacity() < size + num_entries) {
+    entries.reserve(size + num_entries);
+  }
+  advise_huge_pages(entries.data() + size,
+                    num_entries * sizeof(struct BookEntry));
+#ifdef MADV_POPULATE_READ
+  // Fault the whole file in at once rather than a page at a time.
+  madvise((void *)((uintptr_t)data & ~(uintptr_t)4095),
+          num_entries * sizeof(struct BookEntry) + ((uintptr_t)data & 4095),
+          MADV_POPULATE_READ);
+#endif
+  entries.resize(size + num_entries);
+  decode(0, num_entries, entries.data() + size);
 }
 
+// What `write_pg_header` writes, 16 bytes a line.
+static const char PG_HEADER[] = "\0\0\0\0\0\0\0\0@PG@\n1.0"
+                                "\0\0\0\0\0\0\0\0\n2\n1\nnor" // nbvariants
+                                "\0\0\0\0\0\0\0\0mal\nCrea"
+                                "\0\0\0\0\0\0\0\0ted by P"
+                                "\0\0\0\0\0\0\0\0olyglot."
+                                "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+static const size_t PG_HEADER_SIZE = sizeof(PG_HEADER) - 1;
+static_assert(PG_HEADER_SIZE == 0x60);
+
 void write_pg_file(ostream &strm, vector<struct BookEntry> &entries) {
-  // Write header
-  {
-    const char zeros[8] = {0};
-    // 0x0-0x10
-    strm.write(zeros, 8);
-    strm.write("@PG@", 4);
-    strm.write("\x0a", 1);
-    strm.write("1.0", 3);
-
-    // 0x10-0x20
-    strm.write(zeros, 8);
-    strm.write("\x0a", 1);
-    strm.write("2", 1); // nbvariants + 1
-    strm.write("\x0a", 1);
-    strm.write("1", 1); // nbvariants
-    strm.write("\x0a", 1);
-    strm.write("nor", 3);
-
-    // 0x20-0x30
-    strm.write(zeros, 8);
-    strm.write("mal", 3);
-    strm.write("\x0a", 1);
-    strm.write("Crea", 4);
-
-    // 0x30-0x40
-    strm.write(zeros, 8);
-    strm.write("ted by P", 8);
-
-    // 0x40-0x50
-    strm.write(zeros, 8);
-    strm.write("olyglot.", 8);
-
-    // 0x50-0x60
-    strm.write(zeros, 8);
-    strm.write(zeros, 8);
-  }
-
-  for (const struct BookEntry &be : entries) {
-    auto key = swap64(be.key);
-    auto move = swap16(be.move);
-    auto weight = swap16(be.weight);
-    auto learn = swap32(be.learn);
-    strm.write((char *)&key, 8);
-    strm.write((char *)&move, 2);
-    strm.write((char *)&weight, 2);
-    strm.write((char *)&learn, 4);
+  write_pg_header(strm);
+
+  char buf[READ_CHUNK_ENTRIES * sizeof(struct BookEntry)];
+  for (size_t start = 0; start < entries.size();
+       start += READ_CHUNK_ENTRIES) {
+    size_t count = min(entries.size() - start, READ_CHUNK_ENTRIES);
+    encode_entries(entries.data() + start, count, buf);
+    strm.write(buf, count * sizeof(struct BookEntry));
+  }
+}
+
+void write_pg_header(ostream &strm) { strm.write(PG_HEADER, PG_HEADER_SIZE); }
+
+void write_pg_entry(ostream &strm, const struct BookEntry &be) {
+  char buf[sizeof(struct BookEntry)];
+  encode_entries(&be, 1, buf);
+  strm.write(buf, sizeof(buf));
+}
+
+PGWriter::PGWriter() {}
+
+PGWriter::~PGWriter() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+bool PGWriter::open(const string &path) {
+  this->path = path;
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("could not open file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  error = false;
+  staged = vector<struct BookEntry>(STAGE_ENTRIES);
+  num_staged = 0;
+  return write_out(PG_HEADER, PG_HEADER_SIZE);
+}
+
+void PGWriter::write(const struct BookEntry &be) {
+  if (num_staged == staged.size()) {
+    flush();
   }
+  staged[num_staged++] = be;
+}
+
+void PGWriter::write(const struct BookEntry *entries, size_t count) {
+  // Top up what's staged first, to keep the entries in order.
+  while (count > 0 && num_staged > 0) {
+    write(*entries++);
+    count--;
+    if (num_staged == staged.size()) {
+      flush();
+    }
+  }
+  // The rest is encoded straight from `entries`, a buffer at a time.
+  char *bytes = (char *)staged.data();
+  while (count > 0 && !error) {
+    size_t n = min(count, staged.size());
+    encode_entries(entries, n, bytes);
+    write_out(bytes, n * sizeof(struct BookEntry));
+    entries += n;
+    count -= n;
+  }
+}
+
+bool PGWriter::close() {
+  if (fd < 0) {
+    return false;
+  }
+  flush();
+  if (::close(fd) < 0 && !error) {
+    LOG_ERROR("could not write file %s: %s\n", path.c_str(),
+              strerror(errno));
+    error = true;
+  }
+  fd = -1;
+  staged = vector<struct BookEntry>();
+  return !error;
+}
+
+void PGWriter::flush() {
+  // Encoded in place, the staged entries are what goes in the file.
+  char *bytes = (char *)staged.data();
+  encode_entries(staged.data(), num_staged, bytes);
+  write_out(bytes, num_staged * sizeof(struct BookEntry));
+  num_staged = 0;
+}
+
+bool PGWriter::write_out(const char *bytes, size_t size) {
+  while (size > 0 && !error) {
+    ssize_t written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("could not write file %s: %s\n", path.c_str(),
+                strerror(errno));
+      error = true;
+      break;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return !error;
 }
 
 vector<struct BookEntry>
@@ -100,13 +303,7 @@ reduce_to_normal_form(vector<struct BookEntry> &entries) {
     const struct BookEntry &be = *it;
 
     if (curr_be.key == be.key && curr_be.move == be.move) {
-      if (curr_be.weight < UINT16_MAX) {
-        curr_be.weight += 1;
-      } else {
-        LOG_ERROR("Weight is too high for move! I don't want to handle this, "
-                  "so I'll die.");
-        exit(EXIT_FAILURE);
-      }
+      combine_entries(curr_be, be);
     } else {
       reduced_entries.push_back(curr_be);
       curr_be = be;
@@ -117,3 +314,11 @@ reduce_to_normal_form(vector<struct BookEntry> &entries) {
 
   return reduced_entries;
 }
+
+void combine_entries(struct BookEntry &into, const struct BookEntry &be) {
+  // Summing (rather than counting) keeps the weights given by PGBuilder, and
+  // means reducing already reduced entries again gives the same result.
+  // Saturate rather than fail: this runs on sort and merge workers, and a
+  // move played more than UINT16_MAX times is still the most popular one.
+  into.weight = min<uint32_t>((uint32_t)into.weight + be.weight, UINT16_MAX);
+}
@@ -1,6 +1,9 @@
 #ifndef _POLYGLOT_H_
 #define _POLYGLOT_H_
 
+#include "mapped_file.h"
+#include <fstream>
+#include <string>
 #include <vector>
 #include <stdint.h>
 
@@ -18,8 +21,112 @@ static_assert(sizeof(struct BookEntry) == 16);
 
 vector<struct BookEntry> read_pg_file(ifstream &strm);
 
+/*
+ * Skip over the header written by `write_pg_file`, if there is one. Standard
+ * books, like Stockfish's, have none and are left at their first entry.
+ */
+void read_pg_header(ifstream &strm);
+
+/*
+ * Read up to `max_entries` entries following the header, appending them to
+ * `entries`. Returns the number of entries read, 0 at the end of the file.
+ */
+size_t read_pg_entries(ifstream &strm, vector<struct BookEntry> &entries,
+                       size_t max_entries);
+
+/*
+ * A Polyglot file mapped into memory and read in place. Files written by
+ * `write_pg_file` start with a header, which is skipped. Standard books have
+ * none, and are entries from their first byte. The header starts with a zero
+ * key followed by "@PG@", which no book entry does.
+ *
+ * Entries are stored big-endian, and decoded either one at a time, as
+ * they're looked at, or in bulk.
+ */
+class PolyglotFile {
+public:
+  /*
+   * Map the file at `path`. `advice` is passed on to madvise(2), e.g.
+   * MADV_SEQUENTIAL to decode it front to back or MADV_RANDOM to search it.
+   */
+  bool open(const string &path, int advice);
+
+  void close();
+
+  // Whether the file starts with the header written by `write_pg_file`.
+  bool has_header() const;
+
+  // Number of entries in the file.
+  size_t size() const;
+
+  struct BookEntry entry(size_t i) const;
+
+  // Decode `count` entries, starting at entry `start`, into `out`.
+  void decode(size_t start, size_t count, struct BookEntry *out) const;
+
+  // Decode all entries, appending them to `entries`.
+  void decode_all(vector<struct BookEntry> &entries) const;
+
+  // Let go of the pages holding `count` entries from entry `start`, except
+  // one shared with the entries after them. For entries that won't be read
+  // again soon, though they still can be, from the page cache or from disk.
+  void release(size_t start, size_t count) const;
+
+private:
+  MappedFile file;
+  // Where the entries start in the mapping.
+  const char *data = nullptr;
+  size_t num_entries = 0;
+  bool header = false;
+};
+
+/*
+ * Writes a Polyglot file with our header. Entries are staged in a large
+ * buffer, encoded in bulk when it fills up, and written out with a single
+ * write(2). Errors are logged, and reported by `close`.
+ */
+class PGWriter {
+public:
+  PGWriter();
+
+  PGWriter(const PGWriter &) = delete;
+
+  PGWriter &operator=(const PGWriter &) = delete;
+
+  ~PGWriter();
+
+  // Create or truncate the file at `path`, and write the header.
+  bool open(const string &path);
+
+  void write(const struct BookEntry &be);
+
+  void write(const struct BookEntry *entries, size_t count);
+
+  // Write out what's staged and close the file. False if anything couldn't
+  // be written.
+  bool close();
+
+private:
+  // 1 MiB of entries.
+  static const size_t STAGE_ENTRIES = 1 << 16;
+
+  void flush();
+
+  bool write_out(const char *bytes, size_t size);
+
+  int fd = -1;
+  string path;
+  vector<struct BookEntry> staged;
+  size_t num_staged = 0;
+  bool error = false;
+};
+
 void write_pg_file(ostream &strm, vector<struct BookEntry> &entries);
 
+void write_pg_header(ostream &strm);
+
+void write_pg_entry(ostream &strm, const struct BookEntry &be);
+
 /*
  * Entries with the same key and move should "combine" and join weights.
  * Assumes `entries` is already sorted.
@@ -27,4 +134,10 @@ void write_pg_file(ostream &strm, vector<struct BookEntry> &entries);
 vector<struct BookEntry>
 reduce_to_normal_form(vector<struct BookEntry> &entries);
 
+/*
+ * Add the weight of `be` to `into`. Both must have the same key and move.
+ * The sum saturates at UINT16_MAX.
+ */
+void combine_entries(struct BookEntry &into, const struct BookEntry &be);
+
 #endif /* _POLYGLOT_H_ */
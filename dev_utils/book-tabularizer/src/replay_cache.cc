@@ -0,0 +1,54 @@
+#include "replay_cache.h"
+#include <cstring>
+
+// 512 KiB, allocated on the first insert. Small enough to stay in cache,
+// which matters more than holding rarer openings.
+static const int CACHE_BITS = 14;
+
+ReplayCache::ReplayCache() {}
+
+bool ReplayCache::pack_san(string_view san, uint64_t &packed) {
+  while (!san.empty() && strchr("+#!?", san.back()) != nullptr) {
+    san.remove_suffix(1);
+  }
+  if (san.empty() || san.size() > sizeof(packed)) {
+    return false;
+  }
+  packed = 0;
+  memcpy(&packed, san.data(), san.size());
+  return true;
+}
+
+size_t ReplayCache::index(uint64_t hash, uint64_t san) const {
+  uint64_t h = (hash ^ (san * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+  return h >> (64 - CACHE_BITS);
+}
+
+bool ReplayCache::lookup(uint64_t hash, uint64_t san,
+                         struct ReplayStep &step) {
+  lookups++;
+  if (slots.empty()) {
+    return false;
+  }
+  const struct Slot &slot = slots[index(hash, san)];
+  if (slot.hash != hash || slot.san != san) {
+    return false;
+  }
+  step = {.move = Move(slot.move),
+          .encoded = slot.encoded,
+          .child_hash = slot.child_hash};
+  hits++;
+  return true;
+}
+
+void ReplayCache::insert(uint64_t hash, uint64_t san,
+                         const struct ReplayStep &step) {
+  if (slots.empty()) {
+    slots.assign((size_t)1 << CACHE_BITS, {0, 0, 0, 0, 0});
+  }
+  slots[index(hash, san)] = {.hash = hash,
+                             .san = san,
+                             .child_hash = step.child_hash,
+                             .move = step.move.move(),
+                             .encoded = step.encoded};
+}
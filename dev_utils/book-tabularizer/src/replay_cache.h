@@ -0,0 +1,61 @@
+#ifndef _REPLAY_CACHE_H_
+#define _REPLAY_CACHE_H_
+
+#include "chess.h"
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+using namespace chess;
+using namespace std;
+
+// What replaying a SAN move from a position gives.
+struct ReplayStep {
+  Move move;
+  // `move` in polyglot's encoding.
+  uint16_t encoded;
+  // Hash of the position after `move`.
+  uint64_t child_hash;
+};
+
+/*
+ * Remembers replayed moves by (position hash, SAN), so that the opening
+ * plies most games share don't have to be resolved and made on a board
+ * again and again. Direct mapped with a fixed number of slots: an insert
+ * simply replaces whatever was in its slot, so frequent moves stay cached
+ * while rare ones come and go.
+ */
+class ReplayCache {
+public:
+  ReplayCache();
+
+  /*
+   * Pack `san` into a cache key. Check and annotation marks don't change the
+   * move, so they're dropped. Fails for SAN too long to fit, which isn't
+   * cached.
+   */
+  static bool pack_san(string_view san, uint64_t &packed);
+
+  bool lookup(uint64_t hash, uint64_t san, struct ReplayStep &step);
+
+  void insert(uint64_t hash, uint64_t san, const struct ReplayStep &step);
+
+  size_t hits = 0;
+  size_t lookups = 0;
+
+private:
+  struct Slot {
+    uint64_t hash;
+    // 0 marks an empty slot, no SAN packs to 0.
+    uint64_t san;
+    uint64_t child_hash;
+    uint16_t move;
+    uint16_t encoded;
+  };
+
+  size_t index(uint64_t hash, uint64_t san) const;
+
+  vector<struct Slot> slots;
+};
+
+#endif /* _REPLAY_CACHE_H_ */
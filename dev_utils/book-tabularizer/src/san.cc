@@ -0,0 +1,245 @@
+#include "san.h"
+
+static inline bool is_file(char c) { return c >= 'a' && c <= 'h'; }
+
+static inline bool is_rank(char c) { return c >= '1' && c <= '8'; }
+
+static inline Bitboard bb(Square sq) { return Bitboard::fromSquare(sq); }
+
+// Rank of `sq` as seen from `c`'s side of the board, 0 being its back rank.
+static inline int relative_rank(Square sq, Color c) {
+  int rank = sq.index() >> 3;
+  return c == Color::WHITE ? rank : 7 - rank;
+}
+
+/*
+ * Whether `c`'s king is safe once the piece on `from` moved to `to` and the
+ * piece on `captured` (if any) is gone. This covers both pins and evasions,
+ * without computing either mask for the whole board.
+ */
+static bool king_safe_after(const Board &board, Color c, Square from,
+                            Square to, Square captured) {
+  Bitboard occ = (board.occ() & ~bb(from)) | bb(to);
+  Bitboard them = board.us(~c);
+  if (captured != Square::NO_SQ) {
+    them &= ~bb(captured);
+    if (captured != to) {
+      occ &= ~bb(captured);
+    }
+  }
+
+  Square king_sq = board.kingSq(c);
+  if (from == king_sq) {
+    king_sq = to;
+  }
+
+  return (attacks::rook(king_sq, occ) & them &
+          board.pieces(PieceType::ROOK, PieceType::QUEEN)).empty() &&
+         (attacks::bishop(king_sq, occ) & them &
+          board.pieces(PieceType::BISHOP, PieceType::QUEEN)).empty() &&
+         (attacks::knight(king_sq) & them & board.pieces(PieceType::KNIGHT))
+             .empty() &&
+         (attacks::pawn(c, king_sq) & them & board.pieces(PieceType::PAWN))
+             .empty() &&
+         (attacks::king(king_sq) & them & board.pieces(PieceType::KING))
+             .empty();
+}
+
+// Castling is rare enough that asking the move generator is fine.
+static SanStatus resolve_castling(const Board &board, bool king_side,
+                                  Move &move) {
+  Movelist moves;
+  movegen::legalmoves<movegen::MoveGenType::QUIET>(moves, board,
+                                                   PieceGenType::KING);
+  for (const auto &m : moves) {
+    if (m.typeOf() == Move::CASTLING &&
+        (m.to() > m.from()) == king_side) {
+      move = m;
+      return SanStatus::Ok;
+    }
+  }
+  return SanStatus::Illegal;
+}
+
+SanStatus resolve_san(const Board &board, string_view san, Move &move) {
+  if (san.size() < 2) {
+    return SanStatus::Syntax;
+  }
+
+  if (san[0] == 'O' || san[0] == '0') {
+    if (san.size() < 3 || san[1] != '-' || san[2] != san[0]) {
+      return SanStatus::Syntax;
+    }
+    bool long_castle = san.size() >= 5 && san[3] == '-' && san[4] == san[0];
+    return resolve_castling(board, !long_castle, move);
+  }
+
+  // The parse follows uci::parseSanInfo, so the same strings are accepted.
+  PieceType piece = PieceType::PAWN;
+  size_t i = 0;
+  if (!is_file(san[0])) {
+    piece = PieceType(san);
+    if (piece == PieceType::NONE) {
+      return SanStatus::Syntax;
+    }
+    i = 1;
+  }
+
+  int from_file = -1, from_rank = -1, to_file = -1, to_rank = -1;
+  bool capture = false;
+  PieceType promotion = PieceType::NONE;
+
+  if (i < san.size() && is_file(san[i])) {
+    from_file = san[i++] - 'a';
+  }
+  if (i < san.size() && is_rank(san[i])) {
+    from_rank = san[i++] - '1';
+  }
+  if (i < san.size() && san[i] == 'x') {
+    capture = true;
+    i++;
+  }
+  if (i < san.size() && is_file(san[i])) {
+    to_file = san[i++] - 'a';
+  }
+  if (i < san.size() && is_rank(san[i])) {
+    to_rank = san[i++] - '1';
+  }
+  if (i < san.size() && san[i] == '=') {
+    if (i + 1 == san.size()) {
+      return SanStatus::Syntax;
+    }
+    promotion = PieceType(san.substr(i + 1));
+    if (promotion == PieceType::NONE || promotion == PieceType::PAWN ||
+        promotion == PieceType::KING) {
+      return SanStatus::Syntax;
+    }
+  }
+
+  // "Nf3" and "e4" only give a target square.
+  if (to_file < 0 && to_rank < 0) {
+    to_file = from_file;
+    to_rank = from_rank;
+    from_file = from_rank = -1;
+  }
+  if (to_file < 0 || to_rank < 0) {
+    return SanStatus::Syntax;
+  }
+
+  const Color c = board.sideToMove();
+  const Square to(to_file + to_rank * 8);
+  const Bitboard to_bb = bb(to);
+
+  if (board.us(c) & to_bb) {
+    return SanStatus::Illegal;
+  }
+  bool occupied = !(board.us(~c) & to_bb).empty();
+
+  // The origins the moved piece could have come from.
+  Bitboard from_bb;
+  Square captured = occupied ? to : Square(Square::NO_SQ);
+  if (piece == PieceType::PAWN) {
+    Bitboard pawns = board.pieces(PieceType::PAWN, c);
+    // No pawn move ends on the mover's own back rank, and there'd be no square
+    // behind it to look for the pawn on.
+    if (relative_rank(to, c) == 0) {
+      return SanStatus::Illegal;
+    }
+    bool last_rank = relative_rank(to, c) == 7;
+    if (last_rank != (promotion != PieceType::NONE)) {
+      return SanStatus::Illegal;
+    }
+
+    if (capture) {
+      if (!occupied) {
+        if (to != board.enpassantSq()) {
+          return SanStatus::Illegal;
+        }
+        captured = Square(to.index() ^ 8);
+      }
+      from_bb = attacks::pawn(~c, to) & pawns;
+    } else {
+      if (occupied) {
+        return SanStatus::Illegal;
+      }
+      if (from_file < 0) {
+        from_file = to_file;
+      }
+      int back = c == Color::WHITE ? -8 : 8;
+      Square single(to.index() + back);
+      if (pawns & bb(single)) {
+        from_bb = bb(single);
+      } else if (relative_rank(to, c) == 3 && !(board.occ() & bb(single))) {
+        from_bb = pawns & bb(Square(single.index() + back));
+      }
+    }
+  } else {
+    if (capture != occupied || promotion != PieceType::NONE) {
+      return SanStatus::Illegal;
+    }
+    switch (piece) {
+    case PieceType(PieceType::KNIGHT):
+      from_bb = attacks::knight(to);
+      break;
+    case PieceType(PieceType::BISHOP):
+      from_bb = attacks::bishop(to, board.occ());
+      break;
+    case PieceType(PieceType::ROOK):
+      from_bb = attacks::rook(to, board.occ());
+      break;
+    case PieceType(PieceType::QUEEN):
+      from_bb = attacks::queen(to, board.occ());
+      break;
+    default:
+      from_bb = attacks::king(to);
+      break;
+    }
+    from_bb &= board.pieces(piece, c);
+  }
+
+  // Disambiguation given in the SAN.
+  if (from_file >= 0) {
+    from_bb &= Bitboard(File(from_file));
+  }
+  if (from_rank >= 0) {
+    from_bb &= Bitboard(Rank(from_rank));
+  }
+
+  Square from = Square::NO_SQ;
+  while (from_bb) {
+    Square candidate = from_bb.pop();
+    if (!king_safe_after(board, c, candidate, to, captured)) {
+      continue;
+    }
+    if (from != Square::NO_SQ) {
+      return SanStatus::Ambiguous;
+    }
+    from = candidate;
+  }
+  if (from == Square::NO_SQ) {
+    return SanStatus::Illegal;
+  }
+
+  if (promotion != PieceType::NONE) {
+    move = Move::make<Move::PROMOTION>(from, to, promotion);
+  } else if (captured != Square::NO_SQ && captured != to) {
+    move = Move::make<Move::ENPASSANT>(from, to);
+  } else {
+    move = Move::make<Move::NORMAL>(from, to);
+  }
+  return SanStatus::Ok;
+}
+
+const char *san_status_name(SanStatus status) {
+  switch (status) {
+  case SanStatus::Ok:
+    return "ok";
+  case SanStatus::Syntax:
+    return "not SAN";
+  case SanStatus::Illegal:
+    return "illegal";
+  case SanStatus::Ambiguous:
+    return "ambiguous";
+  }
+  return "unknown";
+}
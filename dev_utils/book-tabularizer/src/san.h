@@ -0,0 +1,35 @@
+#ifndef _SAN_H_
+#define _SAN_H_
+
+#include "chess.h"
+#include <string_view>
+
+using namespace chess;
+using namespace std;
+
+enum class SanStatus {
+  Ok,
+  // Not SAN at all, e.g. a missing target square.
+  Syntax,
+  // No legal move matches.
+  Illegal,
+  // More than one legal move matches.
+  Ambiguous,
+};
+
+/*
+ * Resolve `san` to a move on `board`. Accepts the same SAN as
+ * `uci::parseSan` and gives the same move for it, but is meant for bulk
+ * ingestion:
+ * - Candidate origins come straight from the attack tables for the target
+ *   square, rather than generating all legal moves of the piece type.
+ * - Only candidates are checked for legality, by testing whether the king
+ *   would be attacked with the candidate moved.
+ * - Errors are returned rather than thrown, so no strings are built for
+ *   them. `move` is only set when the result is SanStatus::Ok.
+ */
+SanStatus resolve_san(const Board &board, string_view san, Move &move);
+
+const char *san_status_name(SanStatus status);
+
+#endif /* _SAN_H_ */
@@ -0,0 +1,125 @@
+#include "spill.h"
+#include "entry_merge.h"
+#include "tinylogger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <unistd.h>
+
+// Same as `reduce_to_normal_form`, but without a second buffer. Spilling
+// happens exactly when we're short on memory.
+static void reduce_in_place(vector<struct BookEntry> &entries) {
+  if (entries.size() == 0) {
+    return;
+  }
+
+  size_t last = 0;
+  for (size_t i = 1; i < entries.size(); i++) {
+    const struct BookEntry &be = entries[i];
+    if (entries[last].key == be.key && entries[last].move == be.move) {
+      combine_entries(entries[last], be);
+    } else {
+      entries[++last] = be;
+    }
+  }
+  entries.resize(last + 1);
+}
+
+RunSpiller::RunSpiller(size_t memory_budget, const string &tmp_dir)
+    : memory_budget(memory_budget), tmp_dir(tmp_dir) {}
+
+RunSpiller::~RunSpiller() {
+  for (auto &run : runs) {
+    unlink(run.c_str());
+  }
+}
+
+size_t RunSpiller::budget() const { return memory_budget; }
+
+bool RunSpiller::spill(vector<struct BookEntry> &entries) {
+  if (error) {
+    entries.clear();
+    return false;
+  }
+
+  sort(entries.begin(), entries.end());
+  reduce_in_place(entries);
+
+  string path;
+  {
+    lock_guard<mutex> lk(mtx);
+    path = (filesystem::path(tmp_dir) /
+            ("polyglot-operator-" + to_string(getpid()) + "-" +
+             to_string(runs.size()) + ".run"))
+               .string();
+    // Register it right away so it gets cleaned up even if writing fails.
+    runs.push_back(path);
+  }
+
+  FILE *file = fopen(path.c_str(), "wb");
+  bool ok = file != nullptr;
+  if (ok) {
+    ok = fwrite(entries.data(), sizeof(struct BookEntry), entries.size(),
+                file) == entries.size();
+    ok = fclose(file) == 0 && ok;
+  }
+  if (!ok) {
+    LOG_ERROR("could not write run %s: %s\n", path.c_str(), strerror(errno));
+    error = true;
+  } else {
+    LOG_DEBUG("spilled %d entries to %s\n", entries.size(), path.c_str());
+  }
+
+  entries.clear();
+  return ok;
+}
+
+size_t RunSpiller::num_runs() const {
+  lock_guard<mutex> lk(mtx);
+  return runs.size();
+}
+
+bool RunSpiller::failed() const { return error; }
+
+bool RunSpiller::merge(vector<vector<struct BookEntry>> &tails,
+                       const function<void(const struct BookEntry &)> &emit) {
+  if (error) {
+    return false;
+  }
+
+  size_t tail_bytes = 0;
+  for (auto &tail : tails) {
+    sort(tail.begin(), tail.end());
+    reduce_in_place(tail);
+    tail_bytes += tail.size() * sizeof(struct BookEntry);
+  }
+
+  // Whatever the tails leave of the budget is shared by the read buffers,
+  // within reason.
+  size_t read_budget = memory_budget > tail_bytes
+                           ? (memory_budget - tail_bytes) / max(runs.size(),
+                                                                (size_t)1)
+                           : 0;
+  size_t buffer_entries = clamp(read_budget / sizeof(struct BookEntry),
+                                (size_t)1 << 10, (size_t)1 << 16);
+
+  vector<unique_ptr<EntryCursor>> owned;
+  for (auto &tail : tails) {
+    owned.push_back(make_unique<VectorCursor>(tail));
+  }
+  for (auto &run : runs) {
+    owned.push_back(make_unique<RunFileCursor>(run, buffer_entries));
+  }
+
+  LOG_DEBUG("merging %d runs and %d in-memory tails\n", runs.size(),
+            tails.size());
+
+  vector<EntryCursor *> cursors;
+  for (auto &cursor : owned) {
+    cursors.push_back(cursor.get());
+  }
+  return merge_entries(cursors, emit);
+}
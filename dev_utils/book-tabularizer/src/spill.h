@@ -0,0 +1,59 @@
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include "polyglot.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+/*
+ * Sorts and reduces more entries than fit in memory. Whoever collects the
+ * entries hands them over with `spill` once they exceed their share of the
+ * memory budget. They're then sorted, reduced and written out to a temporary
+ * run file. `merge` finally does a streaming k-way merge of all the runs.
+ */
+class RunSpiller {
+public:
+  RunSpiller(size_t memory_budget, const string &tmp_dir);
+
+  RunSpiller(const RunSpiller &) = delete;
+
+  RunSpiller &operator=(const RunSpiller &) = delete;
+
+  ~RunSpiller();
+
+  // Bytes of entries we may hold in memory, in total.
+  size_t budget() const;
+
+  /*
+   * Sort, reduce and write `entries` to a new run, leaving `entries` empty
+   * (but not shrunk). Safe to call from several threads.
+   */
+  bool spill(vector<struct BookEntry> &entries);
+
+  size_t num_runs() const;
+
+  // Whether any spill failed.
+  bool failed() const;
+
+  /*
+   * Merge all runs together with the entries still in memory, calling `emit`
+   * for each sorted, reduced entry. `tails` are sorted and reduced in place
+   * first.
+   */
+  bool merge(vector<vector<struct BookEntry>> &tails,
+             const function<void(const struct BookEntry &)> &emit);
+
+private:
+  size_t memory_budget;
+  string tmp_dir;
+
+  mutable mutex mtx;
+  vector<string> runs;
+  atomic<bool> error = false;
+};
+
+#endif /* _SPILL_H_ */
@@ -0,0 +1,175 @@
+#include "staged_parse.h"
+#include "bounded_queue.h"
+#include "metrics.h"
+#include "pg_builder.h"
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// Games handed to a replay worker at a time. Enough that the queues are
+// touched rarely next to the replaying, few enough that the workers are
+// kept busy on small PGNs.
+static const size_t GAMES_PER_BATCH = 256;
+
+/*
+ * Games as the tokens the parser found in them, back to back in `text`, each
+ * ending at its offset in `ends`. Every game is a number of header keys and
+ * values, in pairs, then a number of moves. No games mark the end of the
+ * PGN.
+ */
+struct GameBatch {
+  string text;
+  vector<uint32_t> ends;
+  // Headers and moves of each game.
+  vector<pair<uint32_t, uint32_t>> games;
+};
+
+// Collects what the parser finds into batches, and queues them.
+class GameBatcher : public pgn::Visitor {
+public:
+  GameBatcher(BoundedQueue<struct GameBatch> &queue, size_t max_moves)
+      : queue(queue), max_moves(max_moves) {}
+
+  void startPgn() { batch.games.emplace_back(0, 0); }
+
+  void header(string_view key, string_view value) {
+    add(key);
+    add(value);
+    batch.games.back().first++;
+  }
+
+  void startMoves() {}
+
+  void move(string_view san, string_view) {
+    add(san);
+    // Nothing past that makes it into the book, the parser can skip it.
+    if (++batch.games.back().second >= max_moves) {
+      skipPgn(true);
+    }
+  }
+
+  void endPgn() {
+    if (batch.games.size() >= GAMES_PER_BATCH) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (!batch.games.empty()) {
+      queue.push(batch);
+      batch = GameBatch();
+    }
+  }
+
+private:
+  void add(string_view token) {
+    batch.text.append(token);
+    batch.ends.push_back(batch.text.size());
+  }
+
+  BoundedQueue<struct GameBatch> &queue;
+  size_t max_moves;
+  struct GameBatch batch;
+};
+
+// Play the games of `batch` to `pg_builder` as the parser would have.
+static void replay(const struct GameBatch &batch, PGBuilder &pg_builder) {
+  string_view text = batch.text;
+  size_t token = 0;
+  uint32_t start = 0;
+  auto next = [&]() {
+    uint32_t end = batch.ends[token++];
+    string_view view = text.substr(start, end - start);
+    start = end;
+    return view;
+  };
+
+  for (auto [headers, moves] : batch.games) {
+    pg_builder.startPgn();
+    for (uint32_t i = 0; i < headers; i++) {
+      string_view key = next();
+      pg_builder.header(key, next());
+    }
+    pg_builder.startMoves();
+    for (uint32_t i = 0; i < moves; i++) {
+      string_view san = next();
+      if (!pg_builder.skip()) {
+        pg_builder.move(san, {});
+      }
+    }
+    pg_builder.endPgn();
+    pg_builder.skipPgn(false);
+  }
+}
+
+pgn::StreamParserError parse_staged(const ParseFn &parse,
+                                    vector<PGBuilder> &pg_builders,
+                                    size_t queue_depth) {
+  size_t workers = pg_builders.size() - 1;
+  BoundedQueue<struct GameBatch> games(queue_depth);
+  BoundedQueue<vector<struct BookEntry>> entries(queue_depth);
+
+  // A game's key takes all of its moves. Otherwise the builders stop after
+  // the move that takes them past the ply limit.
+  auto &first_worker = pg_builders[1];
+  size_t max_moves = first_worker.dedup == Dedup::Games
+                         ? SIZE_MAX
+                         : (size_t)first_worker.max_plies + 1;
+
+  pgn::StreamParserError error;
+  thread tokenizer([&]() {
+    GameBatcher batcher(games, max_moves);
+    error = parse(batcher);
+    batcher.flush();
+    for (size_t i = 0; i < workers; i++) {
+      struct GameBatch end;
+      games.push(end);
+    }
+  });
+
+  vector<thread> replayers;
+  for (size_t i = 1; i <= workers; i++) {
+    replayers.emplace_back([&, i]() {
+      auto &pg_builder = pg_builders[i];
+      struct GameBatch batch;
+      while (true) {
+        games.pop(batch);
+        if (batch.games.empty()) {
+          break;
+        }
+        replay(batch, pg_builder);
+        if (!pg_builder.entries.empty()) {
+          size_t size = pg_builder.entries.size();
+          entries.push(pg_builder.entries);
+          pg_builder.entries = vector<struct BookEntry>();
+          pg_builder.entries.reserve(size);
+        }
+      }
+      // No entries mark that this worker is done.
+      vector<struct BookEntry> end;
+      entries.push(end);
+    });
+  }
+
+  auto &sink = pg_builders[0];
+  vector<struct BookEntry> batch;
+  for (size_t done = 0; done < workers;) {
+    entries.pop(batch);
+    if (batch.empty()) {
+      done++;
+      continue;
+    }
+    sink.take_entries(batch);
+  }
+
+  tokenizer.join();
+  for (auto &replayer : replayers) {
+    replayer.join();
+  }
+
+  if (sink.metrics) {
+    sink.metrics->add_queue("games", games.stats());
+    sink.metrics->add_queue("entries", entries.stats());
+  }
+  return error;
+}
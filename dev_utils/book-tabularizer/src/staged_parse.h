@@ -0,0 +1,34 @@
+#ifndef _STAGED_PARSE_H_
+#define _STAGED_PARSE_H_
+
+#include "chess.h"
+#include <functional>
+#include <vector>
+
+using namespace chess;
+using namespace std;
+
+class PGBuilder;
+
+// Feed everything to a visitor, as pgn::StreamParser::readGames does.
+using ParseFn = function<pgn::StreamParserError(pgn::Visitor &visitor)>;
+
+/*
+ * Parse a PGN in three stages connected by bounded queues, so that reading
+ * the PGN overlaps with replaying its moves even when it can't be split:
+ *
+ *   1. `parse` tokenizes the PGN on a thread of its own, into batches of
+ *      games as header and move tokens.
+ *   2. Every builder but the first replays batches on a thread of its own,
+ *      and hands on the entries of each batch.
+ *   3. The calling thread adds them to the first builder, which aggregates
+ *      and spills them.
+ *
+ * Each queue holds up to `queue_depth` batches. How full they ran and how
+ * long each side waited on them is added to the builders' `metrics`.
+ */
+pgn::StreamParserError parse_staged(const ParseFn &parse,
+                                    vector<PGBuilder> &pg_builders,
+                                    size_t queue_depth);
+
+#endif /* _STAGED_PARSE_H_ */
@@ -0,0 +1,68 @@
+#include "thread_pool.h"
+#include <chrono>
+#include <thread>
+
+ThreadPool::ThreadPool(int threads) {
+  for (int i = 0; i < max(threads, 1); i++) {
+    workers.push_back(make_unique<struct Worker>());
+  }
+}
+
+int ThreadPool::size() const { return workers.size(); }
+
+void ThreadPool::submit(Task task) {
+  auto &worker = *workers[next_worker];
+  next_worker = (next_worker + 1) % workers.size();
+
+  pending++;
+  lock_guard<mutex> lock(worker.mtx);
+  worker.tasks.push_back(std::move(task));
+}
+
+void ThreadPool::spawn(int worker, Task task) {
+  auto &w = *workers[worker];
+  pending++;
+  lock_guard<mutex> lock(w.mtx);
+  w.tasks.push_front(std::move(task));
+}
+
+bool ThreadPool::take(int worker, Task &task) {
+  // Our own tasks first, then everyone else's, starting with our neighbour
+  // so that thieves spread out.
+  for (size_t i = 0; i < workers.size(); i++) {
+    auto &victim = *workers[(worker + i) % workers.size()];
+    lock_guard<mutex> lock(victim.mtx);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::work(int worker) {
+  Task task;
+  while (pending > 0) {
+    if (!take(worker, task)) {
+      // Nothing to take, but a running task may still spawn some. Tasks are
+      // coarse, so there's no hurry.
+      this_thread::sleep_for(chrono::milliseconds(1));
+      continue;
+    }
+    task(worker);
+    task = nullptr;
+    pending--;
+  }
+}
+
+void ThreadPool::run() {
+  vector<thread> threads;
+  for (size_t i = 1; i < workers.size(); i++) {
+    threads.emplace_back(&ThreadPool::work, this, i);
+  }
+  work(0);
+  for (auto &t : threads) {
+    t.join();
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/*
+ * A work-stealing pool for a batch of coarse tasks. Every worker has its own
+ * deque of tasks and takes them from the front. A worker that runs out
+ * takes from the front of another worker's deque instead. Tasks get the
+ * index of the worker that runs them, for per-worker state.
+ *
+ * Tasks are queued with `submit` before `run`, or with `spawn` from inside a
+ * task, which lets a task hand off part of its work to idle workers.
+ */
+class ThreadPool {
+public:
+  using Task = function<void(int worker)>;
+
+  explicit ThreadPool(int threads);
+
+  ThreadPool(const ThreadPool &) = delete;
+
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int size() const;
+
+  // Queue a task. Tasks are dealt round robin, so submitting them in order
+  // of decreasing size has every worker start on the largest ones.
+  void submit(Task task);
+
+  // Queue a task at the front of `worker`'s deque, to be run next.
+  void spawn(int worker, Task task);
+
+  // Run all tasks to completion, the calling thread being worker 0.
+  void run();
+
+private:
+  struct Worker {
+    mutex mtx;
+    deque<Task> tasks;
+  };
+
+  bool take(int worker, Task &task);
+
+  void work(int worker);
+
+  vector<unique_ptr<struct Worker>> workers;
+  size_t next_worker = 0;
+  // Tasks queued or running. Workers only quit once this drops to 0, since
+  // a running task may still spawn more.
+  atomic<size_t> pending = 0;
+};
+
+#endif /* _THREAD_POOL_H_ */
@@ -1,5 +1,7 @@
 #ifndef _LOG_H_
 #define _LOG_H_
+#include <cstdarg>
+#include <cstdio>
 #include <ctime>
 
 namespace tinylogger {
@@ -1,9 +1,28 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
+#include <cstddef>
 #include <cstdint>
 
-uint16_t swap16(uint16_t x);
-uint32_t swap32(uint32_t x);
-uint64_t swap64(uint64_t x);
+// Inline, so that they compile down to a single bswap in tight loops.
+inline uint16_t swap16(uint16_t x) { return (x << 8) | (x >> 8); }
+
+inline uint32_t swap32(uint32_t x) {
+  return ((x << 24) & 0xFF000000) | ((x << 8) & 0x00FF0000) |
+         ((x >> 8) & 0x0000FF00) | ((x >> 24) & 0x000000FF);
+}
+
+inline uint64_t swap64(uint64_t x) {
+  return ((x << 56) & 0xFF00000000000000ULL) |
+         ((x << 40) & 0x00FF000000000000ULL) |
+         ((x << 24) & 0x0000FF0000000000ULL) |
+         ((x << 8) & 0x000000FF00000000ULL) |
+         ((x >> 8) & 0x00000000FF000000ULL) |
+         ((x >> 24) & 0x0000000000FF0000ULL) |
+         ((x >> 40) & 0x000000000000FF00ULL) |
+         ((x >> 56) & 0x00000000000000FFULL);
+}
+
+// Peak resident set size of this process so far, in bytes.
+size_t peak_rss();
 
 #endif /* _UTIL_H_ */
@@ -32,6 +32,9 @@
             clang-tools
             meson
             ninja
+            pkg-config
+            zlib
+            zstd
             act
             wget
             unzip